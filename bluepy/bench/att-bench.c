@@ -0,0 +1,113 @@
+/*
+ *
+ *  Decodes ATT PDUs with attrib/att.c and formats helper-style text
+ *  responses, the helper's main per-PDU work. "make bench" builds it
+ *  with the release flags (att-bench) and the debug flags (att-bench-O0).
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/util.h"
+#include "attrib/att.h"
+
+#define ROUNDS		200000
+
+static char out[4096];
+static size_t outlen;
+
+static void out_printf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	outlen += vsnprintf(out + outlen, sizeof(out) - outlen, fmt, ap);
+	va_end(ap);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t ntfy[23], disc[23], value[20];
+	struct att_data_list *list;
+	unsigned long rounds = ROUNDS;
+	unsigned long i, chk = 0;
+	uint16_t plen, dlen, j;
+	double t;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	/* A 20-byte notification and a characteristic discovery response */
+	for (j = 0; j < sizeof(value); j++)
+		value[j] = j * 7;
+	plen = enc_notification(0x2a, value, sizeof(value), ntfy, sizeof(ntfy));
+
+	disc[0] = ATT_OP_READ_BY_TYPE_RESP;
+	disc[1] = 7;
+	for (j = 0; j < 3; j++) {
+		put_le16(0x10 + j * 3, &disc[2 + j * 7]);
+		disc[4 + j * 7] = 0x12;
+		put_le16(0x11 + j * 3, &disc[5 + j * 7]);
+		put_le16(0x2a00 + j, &disc[7 + j * 7]);
+	}
+	dlen = 2 + 3 * 7;
+
+	/* Decoding: everything up to the values being formatted */
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		list = dec_read_by_type_resp(disc, dlen);
+		for (j = 0; list && j < list->num; j++) {
+			uint8_t *d = list->data[j];
+			bt_uuid_t uuid;
+			char uuidstr[MAX_LEN_UUID_STR];
+
+			bt_uuid16_create(&uuid, get_le16(&d[5]));
+			bt_uuid_to_string(&uuid, uuidstr, sizeof(uuidstr));
+			chk += get_le16(&d[0]) + d[2] + get_le16(&d[3]) +
+								uuidstr[7];
+		}
+		att_data_list_free(list);
+		chk += get_le16(&ntfy[1]);
+	}
+	t = now() - t;
+
+	printf("%s: decode %.3f us per discovery + notification PDU\n",
+						argv[0], t * 1e6 / rounds);
+
+	/* Formatting a notification response */
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		outlen = 0;
+		out_printf("rsp=$ntfy hnd=h%X d=b", get_le16(&ntfy[1]));
+		for (j = 3; j < plen; j++)
+			out_printf("%02X", ntfy[j]);
+		out_printf("\n");
+		chk += outlen;
+	}
+	t = now() - t;
+
+	printf("%s: format %.3f us per notification (%lu)\n", argv[0],
+						t * 1e6 / rounds, chk);
+
+	return 0;
+}
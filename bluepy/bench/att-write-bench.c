@@ -0,0 +1,132 @@
+/*
+ *
+ *  Bursts of Write Commands through bt_att to a SOCK_SEQPACKET peer, as
+ *  in firmware uploads. Built twice by "make bench": with the batched
+ *  writer (att-write-bench) and with the att.c from before it, which sent
+ *  one PDU per wakeup (att-write-bench-nobatch). The sends are counted by
+ *  wrapping writev() and sendmmsg() (-Wl,--wrap), which either writer uses.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <glib.h>
+
+#include "src/shared/util.h"
+#include "src/shared/att.h"
+
+#define ROUNDS		2000
+#define BURST		64
+
+static unsigned long syscalls;
+static int max_batch;
+
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+int __real_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+								int flags);
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	ssize_t ret = __real_writev(fd, iov, iovcnt);
+
+	syscalls++;
+	if (ret > 0 && max_batch < 1)
+		max_batch = 1;
+
+	return ret;
+}
+
+int __wrap_sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen,
+								int flags)
+{
+	int ret = __real_sendmmsg(fd, msgvec, vlen, flags);
+
+	syscalls++;
+	if (ret > max_batch)
+		max_batch = ret;
+
+	return ret;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read whatever the peer has received so far, one PDU per message */
+static unsigned int drain(int fd)
+{
+	uint8_t buf[64];
+	unsigned int count = 0;
+
+	while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+		count++;
+
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bt_att *att;
+	unsigned long rounds = ROUNDS;
+	unsigned long i, wakeups = 0;
+	unsigned int j, received;
+	uint8_t pdu[22];
+	int sv[2];
+	double t;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+
+	att = bt_att_new(sv[0]);
+	if (!att)
+		return 1;
+
+	/* Handle and a 20-byte value */
+	put_le16(0x0010, pdu);
+	for (j = 2; j < sizeof(pdu); j++)
+		pdu[j] = j;
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		for (j = 0; j < BURST; j++)
+			bt_att_send(att, BT_ATT_OP_WRITE_CMD, pdu, sizeof(pdu),
+							NULL, NULL, NULL);
+
+		for (received = 0; received < BURST; wakeups++) {
+			g_main_context_iteration(NULL, TRUE);
+			received += drain(sv[1]);
+		}
+	}
+	t = now() - t;
+
+	printf("%s: %.3f us per PDU, %.2f wakeups and %.2f sends per burst "
+				"of %d (largest batch %d)\n", argv[0],
+				t * 1e6 / (rounds * BURST),
+				(double) wakeups / rounds,
+				(double) syscalls / rounds, BURST, max_batch);
+
+	bt_att_unref(att);
+	close(sv[1]);
+
+	return 0;
+}
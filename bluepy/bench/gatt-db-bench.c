@@ -0,0 +1,136 @@
+/*
+ *
+ *  Handle lookups in a gatt_db of 40 services, each with 10 characteristics
+ *  carrying a CCC and a user description descriptor (1640 attributes), as
+ *  a large HID or mesh proxy server would hold. Built twice by "make bench":
+ *  with the handle index (gatt-db-bench) and with the gatt-db.c it replaced
+ *  (gatt-db-bench-noindex).
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lib/bluetooth.h"
+#include "lib/uuid.h"
+#include "src/shared/att.h"
+#include "src/shared/queue.h"
+#include "src/shared/gatt-db.h"
+
+#define ROUNDS		200000
+#define NUM_SERVICES	40
+#define NUM_CHARS	10
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct gatt_db *build_db(uint16_t *last_handle)
+{
+	struct gatt_db_attribute *svc, *attr = NULL;
+	struct gatt_db *db;
+	bt_uuid_t uuid;
+	int i, j;
+
+	db = gatt_db_new();
+
+	for (i = 0; i < NUM_SERVICES; i++) {
+		bt_uuid16_create(&uuid, 0x1812);
+		svc = gatt_db_add_service(db, &uuid, true, 1 + NUM_CHARS * 4);
+
+		for (j = 0; j < NUM_CHARS; j++) {
+			bt_uuid16_create(&uuid, 0x2a4d);
+			gatt_db_service_add_characteristic(svc, &uuid,
+						BT_ATT_PERM_READ,
+						BT_GATT_CHRC_PROP_READ |
+						BT_GATT_CHRC_PROP_NOTIFY,
+						NULL, NULL, NULL);
+
+			bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+			gatt_db_service_add_descriptor(svc, &uuid,
+						BT_ATT_PERM_READ |
+						BT_ATT_PERM_WRITE,
+						NULL, NULL, NULL);
+
+			bt_uuid16_create(&uuid, GATT_CHARAC_USER_DESC_UUID);
+			attr = gatt_db_service_add_descriptor(svc, &uuid,
+						BT_ATT_PERM_READ,
+						NULL, NULL, NULL);
+		}
+
+		gatt_db_service_set_active(svc, true);
+	}
+
+	*last_handle = gatt_db_attribute_get_handle(attr);
+
+	return db;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long rounds = ROUNDS;
+	unsigned long i, chk = 0;
+	struct gatt_db *db;
+	struct queue *q;
+	bt_uuid_t chrc;
+	uint16_t last, handle, start;
+	double t;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	db = build_db(&last);
+	q = queue_new();
+	bt_uuid16_create(&chrc, GATT_CHARAC_UUID);
+
+	/* Attribute reads and writes, spread over the whole database */
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		handle = 1 + (i * 7919) % last;
+		chk += gatt_db_get_attribute(db, handle) != NULL;
+	}
+	t = now() - t;
+
+	printf("%s: %u attributes, get_attribute %.3f us\n", argv[0], last,
+						t * 1e6 / rounds);
+
+	/* Characteristic discovery, one service's range at a time */
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		start = 1 + (i % NUM_SERVICES) * (1 + NUM_CHARS * 4);
+		gatt_db_read_by_type(db, start, start + NUM_CHARS * 4, chrc, q);
+		chk += queue_length(q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+	t = now() - t;
+
+	printf("%s: read_by_type over one service %.3f us\n", argv[0],
+						t * 1e6 / rounds);
+
+	/* Descriptor discovery, a few handles near the end */
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		gatt_db_find_information(db, last - 2, last, q);
+		chk += queue_length(q);
+		queue_remove_all(q, NULL, NULL, NULL);
+	}
+	t = now() - t;
+
+	printf("%s: find_information near the end %.3f us (%lu)\n", argv[0],
+						t * 1e6 / rounds, chk);
+
+	queue_destroy(q, NULL);
+	gatt_db_unref(db);
+
+	return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ *
+ *  Hex encoding and decoding of attribute values, as done for every value
+ *  the helper sends or receives in its text protocol. Compares the table
+ *  driven util_hex_encode/util_hex_decode with per-byte printf/strtol, and
+ *  a whole notification line written to /dev/null either way.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/shared/util.h"
+
+#define ROUNDS		20000
+
+static const size_t sizes[] = { 20, 64, 128, 256, 512 };
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void printf_encode(const uint8_t *src, size_t len, char *dst)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		sprintf(dst + 2 * i, "%02X", src[i]);
+}
+
+static void strtol_decode(const char *src, size_t len, uint8_t *dst)
+{
+	char tmp[3];
+	size_t i;
+
+	tmp[2] = '\0';
+	for (i = 0; i < len / 2; i++) {
+		memcpy(tmp, src + (i * 2), 2);
+		dst[i] = (uint8_t) strtol(tmp, NULL, 16);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t value[512], out[512];
+	char hex[1025], line[1100];
+	unsigned long rounds = ROUNDS;
+	unsigned long i, chk = 0;
+	double t_old, t_new;
+	size_t n, j, len;
+	FILE *null_file;
+	int null_fd;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	for (j = 0; j < sizeof(value); j++)
+		value[j] = j * 37;
+
+	for (n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		len = sizes[n];
+
+		t_old = now();
+		for (i = 0; i < rounds; i++) {
+			printf_encode(value, len, hex);
+			chk += hex[i % len];
+		}
+		t_old = now() - t_old;
+
+		t_new = now();
+		for (i = 0; i < rounds; i++) {
+			util_hex_encode(value, len, hex);
+			chk += hex[i % len];
+		}
+		t_new = now() - t_new;
+
+		printf("%s: encode %3zu bytes: %7.3f us printf, %6.3f us "
+				"table\n", argv[0], len, t_old * 1e6 / rounds,
+				t_new * 1e6 / rounds);
+
+		t_old = now();
+		for (i = 0; i < rounds; i++) {
+			strtol_decode(hex, 2 * len, out);
+			chk += out[i % len];
+		}
+		t_old = now() - t_old;
+
+		t_new = now();
+		for (i = 0; i < rounds; i++) {
+			util_hex_decode(hex, 2 * len, out);
+			chk += out[i % len];
+		}
+		t_new = now() - t_new;
+
+		printf("%s: decode %3zu bytes: %7.3f us strtol, %6.3f us "
+				"table\n", argv[0], len, t_old * 1e6 / rounds,
+				t_new * 1e6 / rounds);
+	}
+
+	/* A 20-byte notification line, stdio per field versus one write */
+	null_file = fopen("/dev/null", "w");
+	null_fd = open("/dev/null", O_WRONLY);
+	if (!null_file || null_fd < 0) {
+		perror("/dev/null");
+		return 1;
+	}
+
+	t_old = now();
+	for (i = 0; i < rounds; i++) {
+		fprintf(null_file, "rsp=$ntfy");
+		fprintf(null_file, " id=h%X", 0);
+		fprintf(null_file, " hnd=h%X", 0x2a);
+		fprintf(null_file, " d=b");
+		for (j = 0; j < 20; j++)
+			fprintf(null_file, "%02X", value[j]);
+		fprintf(null_file, "\n");
+		fflush(null_file);
+	}
+	t_old = now() - t_old;
+
+	t_new = now();
+	for (i = 0; i < rounds; i++) {
+		len = sprintf(line, "rsp=$ntfy id=h0 hnd=h2A d=b");
+		util_hex_encode(value, 20, line + len);
+		len += 40;
+		line[len++] = '\n';
+		chk += write(null_fd, line, len);
+	}
+	t_new = now() - t_new;
+
+	printf("%s: ntfy line: %.3f us stdio, %.3f us one write (%lu)\n",
+				argv[0], t_old * 1e6 / rounds,
+				t_new * 1e6 / rounds, chk);
+
+	fclose(null_file);
+	close(null_fd);
+
+	return 0;
+}
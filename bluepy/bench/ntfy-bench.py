@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+#
+#  Notifications per second per core handled by btle.py, from the helper's
+#  output in the receive buffer to a delegate that unpacks each payload with
+#  struct, as sensortag.py does. The helper's output is generated here, for
+#  a shared helper's connection 1, so no device or helper process is needed:
+#  6-byte accelerometer readings, and 244-byte payloads (the most a 247-byte
+#  MTU carries) as a data stream would send. Run by "make bench" for the text
+#  and binary protocols, with the generic parsers, the notification fast
+#  path, and the fast path passing memoryviews (notifyViews).
+#
+
+from __future__ import print_function
+
+import os
+import struct
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+import btle
+
+COUNT = 100000
+READ_SIZE = 65536   # As BluepyHelper._fill() reads
+
+cpu_time = time.process_time if hasattr(time, 'process_time') else time.clock
+
+
+def text_line(connId, hnd, data, ts, tns, seq):
+    return ("rsp=$ntfy id=h%X hnd=h%X d=b%s ts=h%X tns=h%X seq=h%X\n" %
+            (connId, hnd, data.hex().upper() if hasattr(data, 'hex')
+             else data.encode('hex').upper(), ts, tns, seq)).encode('ascii')
+
+
+def binary_frame(connId, hnd, data, ts, tns, seq):
+    def uint(tag, val):
+        return struct.pack('<B', len(tag)) + tag + b'h' + struct.pack('<I', val)
+    body = b'R' + struct.pack('<B', 3) + b'rsp$' + struct.pack('<H', 4) + b'ntfy'
+    body += uint(b'id', connId) + uint(b'hnd', hnd)
+    body += struct.pack('<B', 1) + b'db' + struct.pack('<H', len(data)) + data
+    body += uint(b'ts', ts) + uint(b'tns', tns) + uint(b'seq', seq)
+    return struct.pack('<I', len(body)) + body
+
+
+class Delegate(btle.DefaultDelegate):
+    def __init__(self):
+        btle.DefaultDelegate.__init__(self)
+        self.count = 0
+        self.sum = 0
+
+    def handleNotification(self, cHandle, data):
+        (x, y, z) = struct.unpack_from('<hhh', data)
+        self.count += 1
+        self.sum += x + y + z
+
+
+def run(binary, fast, views, stream):
+    btle.BluepyHelper._fastNotify = fast
+    helper = btle.BluepyHelper(binary, views)
+    periph = btle.Peripheral(helper=helper)
+    periph._connId = helper.attach(periph)
+    delegate = Delegate()
+    periph.setDelegate(delegate)
+
+    t = cpu_time()
+    for pos in range(0, len(stream), READ_SIZE):
+        helper._rxbuf.extend(stream[pos:pos+READ_SIZE])
+        helper._dispatchBuffered()
+    t = cpu_time() - t
+
+    helper.detach(periph._connId)
+    return (t, delegate)
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else COUNT
+    name = os.path.basename(sys.argv[0])
+
+    for size in (6, 244):
+        for binary in (False, True):
+            make = binary_frame if binary else text_line
+            stream = b''.join(make(1, 0x2c,
+                                   struct.pack('<hhh', i % 100, -(i % 7), 3) +
+                                   b'\x55' * (size - 6),
+                                   1700000000 + i // 1000,
+                                   (i % 1000) * 1000000, i)
+                              for i in range(count))
+            expect = None
+            for (fast, views, label) in ((False, False, "generic"),
+                                         (True, False, "fast path"),
+                                         (True, True, "memoryviews")):
+                (t, delegate) = run(binary, fast, views, stream)
+                if delegate.count != count or \
+                   delegate.sum != (expect or delegate.sum):
+                    print("%s: %s results differ" % (name, label))
+                    return 1
+                expect = delegate.sum
+                print("%s: %3d bytes, %-6s protocol, %-11s %7.0f notifications/s per core" %
+                      (name, size, "binary" if binary else "text", label,
+                       count / t))
+
+    btle.BluepyHelper._fastNotify = True
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,62 @@
+/*
+ *
+ *  Push/pop throughput of src/shared/queue, as used by the bt_att send
+ *  queues. Built twice by "make bench": with the queue entry pool
+ *  (queue-bench) and with the queue.c from before it (queue-bench-nopool).
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "src/shared/queue.h"
+
+#define ROUNDS		2000000
+#define DEPTH		4
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct queue *queue;
+	unsigned long rounds = ROUNDS;
+	unsigned long i;
+	int d;
+	double t;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+
+	queue = queue_new();
+
+	t = now();
+	for (i = 0; i < rounds; i++) {
+		/* A few PDUs in flight, as on a busy connection */
+		for (d = 0; d < DEPTH; d++)
+			queue_push_tail(queue, &queue);
+
+		for (d = 0; d < DEPTH; d++)
+			queue_pop_head(queue);
+	}
+	t = now() - t;
+
+	printf("%s: %lu push/pop pairs in %.3f s, %.1f ns each\n", argv[0],
+					rounds * DEPTH, t,
+					t * 1e9 / (rounds * DEPTH));
+
+	queue_destroy(queue, NULL);
+
+	return 0;
+}
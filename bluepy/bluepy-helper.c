@@ -37,43 +37,92 @@
 
 #include <errno.h>
 #include <assert.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <glib.h>
 
 #include "lib/bluetooth.h"
 #include "lib/hci.h"
+#include "lib/hci_lib.h"
 #include "lib/sdp.h"
 #include "lib/uuid.h"
 #include "src/shared/util.h"
+#include "src/shared/queue.h"
+#include "src/shared/ringbuf.h"
+#include "src/shared/att.h"
+#include "src/shared/io.h"
+#include "src/shared/timeout.h"
+#ifdef MAINLOOP_EPOLL
+#include "src/shared/mainloop.h"
+#endif
+#include "src/textfile.h"
 #include "btio/btio.h"
 #include "attrib/att.h"
 #include "attrib/gattrib.h"
 #include "attrib/gatt.h"
 #include "attrib/gatttool.h"
 
-static void cmd_help(int argcp, char **argvp);
-static void cmd_status(int argcp, char **argvp);
+/* Largest ATT MTU offered: a 512-byte value plus the Prepare Write header */
+#define ATT_MAX_LE_MTU	517
+
+enum state {
+	STATE_DISCONNECTED=0,
+	STATE_CONNECTING=1,
+	STATE_CONNECTED=2
+};
+
+/*
+ * Per-connection state. Commands may be prefixed with "@<id>" (in hex) to
+ * select a connection; untagged commands use connection 0. Every response
+ * relating to a connection carries its id, so that one helper process can
+ * serve many peripherals.
+ */
+struct conn {
+	unsigned int id;
+	GIOChannel *iochannel;
+	GAttrib *attrib;
+	unsigned int disconn_id;	/* bt_att disconnect handler */
+	enum state state;
+	gchar *dst;
+	gchar *dst_type;
+	gchar *sec_level;
+	int mtu;
+	int conn_mtu;		/* MTU to offer on connect, 0 for none */
+	int mtu_offered;	/* MTU sent in this connection's exchange */
+	GSList *batches;
+	GSList *discoveries;
+	GSList *streams;
+	uint16_t svc_changed_hnd;
+	unsigned int event_seq;		/* Notifications and indications */
+	struct param_update *param_update;
+	uint16_t conn_interval;		/* 1.25 ms units, 0 until updated */
+	uint16_t conn_latency;
+	uint16_t conn_timeout;		/* 10 ms units */
+	int connect_ms;			/* Time spent trying to connect */
+	int reconn_max;			/* Attempts after a drop, 0 for none */
+	int reconn_tries;		/* Attempts since the link dropped */
+	unsigned int reconn_id;		/* Backoff before the next attempt */
+	GSList *subscriptions;
+};
+
+static void cmd_help(struct conn *conn, int argcp, char **argvp);
+static void cmd_status(struct conn *conn, int argcp, char **argvp);
 
-static GIOChannel *iochannel = NULL;
-static GAttrib *attrib = NULL;
+#ifndef MAINLOOP_EPOLL
 static GMainLoop *event_loop;
+#endif
+static gboolean quitting;
+static GHashTable *conns;
 
 static gchar *opt_src = NULL;
-static gchar *opt_dst = NULL;
-static gchar *opt_dst_type = NULL;
-static gchar *opt_sec_level = NULL;
+static gchar *opt_cache_dir = NULL;
 static const int opt_psm = 0;
-static int opt_mtu = 0;
-static int start;
-static int end;
-
-static enum state {
-	STATE_DISCONNECTED=0,
-	STATE_CONNECTING=1,
-	STATE_CONNECTED=2
-} conn_state;
 
 static const char 
   *tag_RESPONSE     = "rsp",
+  *tag_CONN_ID      = "id",
   *tag_ERRCODE      = "code",
   *tag_HANDLE       = "hnd",
   *tag_UUID         = "uuid",
@@ -85,7 +134,25 @@ static const char
   *tag_RANGE_START  = "hstart",
   *tag_RANGE_END    = "hend",
   *tag_PROPERTIES   = "props",
-  *tag_VALUE_HANDLE = "vhnd";
+  *tag_VALUE_HANDLE = "vhnd",
+  *tag_ATT_STATUS   = "status",
+  *tag_ADDR         = "addr",
+  *tag_ADDR_TYPE    = "type",
+  *tag_ADV_TYPE     = "evt",
+  *tag_RSSI         = "rssi",
+  *tag_LENGTH       = "len",
+  *tag_CHUNKS       = "n",
+  *tag_ELAPSED_US   = "us",
+  *tag_RESPONSES    = "resps",
+  *tag_FLUSHES      = "flushes",
+  *tag_MAX_BATCH    = "maxbatch",
+  *tag_TIME_SEC     = "ts",
+  *tag_TIME_NSEC    = "tns",
+  *tag_SEQUENCE     = "seq",
+  *tag_INTERVAL     = "intvl",
+  *tag_LATENCY      = "lat",
+  *tag_SUPERVISION  = "tmo",
+  *tag_RECONNECT    = "reconn";
 
 static const char
   *rsp_ERROR       = "err",
@@ -95,7 +162,13 @@ static const char
   *rsp_DISCOVERY   = "find",
   *rsp_DESCRIPTORS = "desc",
   *rsp_READ        = "rd",
-  *rsp_WRITE       = "wr";
+  *rsp_READ_MULTI  = "rdm",
+  *rsp_WRITE       = "wr",
+  *rsp_STREAM      = "wrs",
+  *rsp_OUTPUT_STATS = "ostat",
+  *rsp_BATCH       = "batch",
+  *rsp_SCAN        = "scan",
+  *rsp_SCAN_END    = "scanend";
 
 static const char
   *err_CONN_FAIL = "connfail",
@@ -111,56 +184,524 @@ static const char
   *st_CONNECTING   = "tryconn",
   *st_CONNECTED    = "conn";
 
-static void resp_begin(const char *rsptype)
+/*
+ * Responses are normally sent as a line of text, one "tag=value" item per
+ * field. With the -b option they are sent as binary frames instead:
+ *
+ *   u32 payload length (LE) | u8 frame type | fields...
+ *
+ * The frame type is FRAME_RESPONSE or FRAME_COMMENT; a comment frame holds
+ * the text of a '#' line. Each response field is encoded as:
+ *
+ *   u8 tag length | tag | u8 value type | value
+ *
+ * where the value type is the same character used in the text protocol.
+ * VAL_UINT values are u32 (LE), all others are a u16 (LE) length followed
+ * by the raw bytes, so data is passed through without hex encoding.
+ */
+#define FRAME_RESPONSE	'R'
+#define FRAME_COMMENT	'#'
+
+#define VAL_SYMBOL	'$'
+#define VAL_STRING	'\''
+#define VAL_UINT	'h'
+#define VAL_DATA	'b'
+
+static gboolean opt_binary = FALSE;
+
+/*
+ * Each response or comment is built up in this buffer, as a text line or
+ * a binary frame, and then queued for output as a whole.
+ */
+static struct {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+} frame;
+
+static void frame_reserve(size_t len)
+{
+	if (frame.len + len > frame.size) {
+		frame.size = MAX(frame.size * 2, frame.len + len);
+		frame.data = g_realloc(frame.data, frame.size);
+	}
+}
+
+static void frame_put(const void *src, size_t len)
+{
+	frame_reserve(len);
+	memcpy(frame.data + frame.len, src, len);
+	frame.len += len;
+}
+
+static void frame_puts(const char *str)
+{
+	frame_put(str, strlen(str));
+}
+
+static void frame_begin(uint8_t type)
+{
+	uint8_t hdr[5] = { 0, 0, 0, 0, type };
+
+	frame.len = 0;
+	frame_put(hdr, sizeof(hdr));
+}
+
+static void frame_field(const char *tag, uint8_t type, const void *val,
+								size_t len)
+{
+	uint8_t hdr[2];
+
+	hdr[0] = strlen(tag);
+	frame_put(hdr, 1);
+	frame_put(tag, hdr[0]);
+
+	hdr[0] = type;
+	frame_put(hdr, 1);
+
+	if (type == VAL_UINT) {
+		frame_put(val, 4);
+		return;
+	}
+
+	put_le16(len, hdr);
+	frame_put(hdr, 2);
+	frame_put(val, len);
+}
+
+/* Text fields: " tag=" followed by the value type character */
+static void frame_tag(const char *tag, char type)
+{
+	frame_put(" ", 1);
+	frame_puts(tag);
+	frame_put("=", 1);
+	frame_put(&type, 1);
+}
+
+/*
+ * Finished responses are queued in a ring buffer and written to stdout once
+ * it is writable, i.e. once per main loop iteration, so that a burst of
+ * notifications costs one write(). The queue is written at once if it is
+ * full or its oldest response has waited OUTPUT_DEADLINE_US.
+ */
+#define OUTPUT_SIZE		65536
+#define OUTPUT_DEADLINE_US	10000
+
+static struct ringbuf *output;
+static struct io *output_io;
+static gboolean output_waiting;
+static gint64 output_since;
+
+static struct {
+	unsigned long responses;
+	unsigned long flushes;
+	unsigned int pending;		/* Responses since the last flush */
+	unsigned int max_per_flush;
+} output_stats;
+
+static void output_write(const void *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(STDOUT_FILENO, data, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		data = (const uint8_t *) data + n;
+		len -= n;
+	}
+}
+
+static void output_flush(void)
+{
+	if (output_waiting) {
+		io_set_write_handler(output_io, NULL, NULL, NULL);
+		output_waiting = FALSE;
+	}
+
+	while (ringbuf_len(output) > 0) {
+		if (ringbuf_write(output, STDOUT_FILENO) < 0 && errno != EINTR) {
+			ringbuf_drain(output, ringbuf_len(output));
+			break;
+		}
+	}
+
+	if (output_stats.pending == 0)
+		return;
+
+	output_stats.flushes++;
+	output_stats.max_per_flush = MAX(output_stats.max_per_flush,
+							output_stats.pending);
+	output_stats.pending = 0;
+}
+
+static bool output_ready(struct io *io, void *user_data)
+{
+	output_waiting = FALSE;
+	output_flush();
+
+	return false;
+}
+
+static void frame_write(void)
+{
+	output_stats.responses++;
+
+	if (frame.len > ringbuf_avail(output)) {
+		output_flush();
+
+		/* Too big to queue at all */
+		if (frame.len > ringbuf_avail(output)) {
+			output_write(frame.data, frame.len);
+			output_stats.flushes++;
+			return;
+		}
+	}
+
+	if (ringbuf_len(output) == 0)
+		output_since = g_get_monotonic_time();
+
+	ringbuf_append(output, frame.data, frame.len);
+	output_stats.pending++;
+
+	if (g_get_monotonic_time() - output_since >= OUTPUT_DEADLINE_US)
+		output_flush();
+	else if (!output_waiting) {
+		output_waiting = io_set_write_handler(output_io, output_ready,
+								NULL, NULL);
+		/* Not pollable (epoll refuses regular files) */
+		if (!output_waiting)
+			output_flush();
+	}
+}
+
+static void frame_end(void)
+{
+	put_le32(frame.len - 4, frame.data);
+	frame_write();
+}
+
+static void send_uint(const char *tag, unsigned int val);
+
+static void resp_begin(struct conn *conn, const char *rsptype)
 {
-	printf("%s=$%s", tag_RESPONSE, rsptype);
+	if (opt_binary) {
+		frame_begin(FRAME_RESPONSE);
+		frame_field(tag_RESPONSE, VAL_SYMBOL, rsptype, strlen(rsptype));
+	} else {
+		frame.len = 0;
+		frame_puts(tag_RESPONSE);
+		frame_put("=$", 2);
+		frame_puts(rsptype);
+	}
+
+	if (conn)
+		send_uint(tag_CONN_ID, conn->id);
 }
 
 static void send_sym(const char *tag, const char *val)
 {
-	printf(" %s=$%s", tag, val);
+	if (opt_binary) {
+		frame_field(tag, VAL_SYMBOL, val, strlen(val));
+		return;
+	}
+
+	frame_tag(tag, VAL_SYMBOL);
+	frame_puts(val);
 }
 
+/* Text of the uint and string fields sent while non-NULL, for the cache */
+static GString *resp_record;
+
 static void send_uint(const char *tag, unsigned int val)
 {
-	printf(" %s=h%X", tag, val);
+	char buf[8];
+	int i = sizeof(buf);
+
+	if (resp_record)
+		g_string_append_printf(resp_record, " %s=h%X", tag, val);
+
+	if (opt_binary) {
+		put_le32(val, buf);
+		frame_field(tag, VAL_UINT, buf, 4);
+		return;
+	}
+
+	do {
+		buf[--i] = "0123456789ABCDEF"[val & 0xf];
+		val >>= 4;
+	} while (val);
+
+	frame_tag(tag, VAL_UINT);
+	frame_put(buf + i, sizeof(buf) - i);
 }
 
 static void send_str(const char *tag, const char *val)
 {
+	if (resp_record)
+		g_string_append_printf(resp_record, " %s='%s", tag, val);
+
+	if (opt_binary) {
+		frame_field(tag, VAL_STRING, val, val ? strlen(val) : 0);
+		return;
+	}
+
 	//!!FIXME
-	printf(" %s='%s", tag, val);
+	frame_tag(tag, VAL_STRING);
+	frame_puts(val ? val : "(null)");
 }
 
 static void send_data(const unsigned char *val, size_t len)
 {
-	printf(" %s=b", tag_DATA);
-	while ( len-- > 0 )
-		printf("%02X", *val++);
+	if (opt_binary) {
+		frame_field(tag_DATA, VAL_DATA, val, len);
+		return;
+	}
+
+	frame_tag(tag_DATA, VAL_DATA);
+	frame_reserve(2 * len);
+	util_hex_encode(val, len, (char *) frame.data + frame.len);
+	frame.len += 2 * len;
 }
 
 static void resp_end()
 {
-	printf("\n");
-	fflush(stdout);
+	if (opt_binary) {
+		frame_end();
+		return;
+	}
+
+	frame_put("\n", 1);
+	frame_write();
+}
+
+static void resp_comment(const char *fmt, ...)
+{
+	va_list ap;
+	char *text;
+
+	va_start(ap, fmt);
+	text = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	if (opt_binary) {
+		frame_begin(FRAME_COMMENT);
+		frame_puts(text);
+		frame_end();
+	} else {
+		frame.len = 0;
+		frame_put("# ", 2);
+		frame_puts(text);
+		frame_put("\n", 1);
+		frame_write();
+	}
+
+	g_free(text);
 }
 
-static void resp_error(const char *errcode)
+static void resp_error(struct conn *conn, const char *errcode)
 {
-	resp_begin(rsp_ERROR);
+	resp_begin(conn, rsp_ERROR);
 	send_sym(tag_ERRCODE, errcode);
 	resp_end();
 }
 
-static void set_state(enum state st)
+static void set_state(struct conn *conn, enum state st)
+{
+	conn->state = st;
+	cmd_status(conn, 0, NULL);
+
+	/* A reconnect ends in whichever state it reaches */
+	if (st != STATE_CONNECTING)
+		conn->reconn_tries = 0;
+}
+
+/*
+ * With the -c option, discovery responses are kept in a file per device
+ * under the cache directory, keyed by the command that produced them, and
+ * replayed on later connections without any ATT traffic. The file is
+ * removed when the device indicates that its services have changed.
+ */
+static char *cache_path(struct conn *conn)
+{
+	char *addr, *path;
+
+	if (!opt_cache_dir || !conn->dst)
+		return NULL;
+
+	addr = g_ascii_strup(conn->dst, -1);
+	path = g_build_filename(opt_cache_dir, addr, NULL);
+	g_free(addr);
+
+	return path;
+}
+
+static char *cache_key(char **argvp)
+{
+	char *key, *lkey;
+
+	key = g_strjoinv(":", argvp);
+	lkey = g_ascii_strdown(key, -1);
+	g_free(key);
+
+	return lkey;
+}
+
+static void cache_store(struct conn *conn, const char *key, const char *value)
+{
+	char *path = cache_path(conn);
+
+	if (!path)
+		return;
+
+	if (create_file(path, S_IRUSR | S_IWUSR) < 0 ||
+					textfile_put(path, key, value) < 0)
+		resp_comment("Can't write attribute cache %s", path);
+
+	g_free(path);
+}
+
+static void cache_load(struct conn *conn)
+{
+	char *path = cache_path(conn);
+	char *value;
+
+	conn->svc_changed_hnd = 0;
+
+	if (!path)
+		return;
+
+	value = textfile_get(path, "svcchg");
+	if (value) {
+		conn->svc_changed_hnd = strtol(value, NULL, 16);
+		free(value);
+	}
+
+	g_free(path);
+}
+
+static void cache_invalidate(struct conn *conn)
+{
+	char *path = cache_path(conn);
+
+	if (!path)
+		return;
+
+	unlink(path);
+	resp_comment("Services changed, attribute cache for %s cleared",
+								conn->dst);
+	g_free(path);
+}
+
+static gboolean cache_replay(struct conn *conn, const char *rsptype,
+								char **argvp)
+{
+	char *path = cache_path(conn);
+	char *key, *value;
+	gchar **fields;
+	int i;
+
+	if (!path)
+		return FALSE;
+
+	key = cache_key(argvp);
+	value = textfile_get(path, key);
+	g_free(key);
+	g_free(path);
+
+	if (!value)
+		return FALSE;
+
+	fields = g_strsplit(value, " ", 0);
+	resp_begin(conn, rsptype);
+	for (i = 0; fields[i]; i++) {
+		char *val = strchr(fields[i], '=');
+
+		if (!val || val[1] == '\0')
+			continue;
+
+		*val++ = '\0';
+		if (*val == 'h')
+			send_uint(fields[i], strtoul(val + 1, NULL, 16));
+		else if (*val == '\'')
+			send_str(fields[i], val + 1);
+	}
+	resp_end();
+
+	g_strfreev(fields);
+	free(value);
+
+	return TRUE;
+}
+
+/* A discovery request in progress, and where to cache its result */
+struct discovery {
+	struct conn *conn;
+	char *cache_key;
+};
+
+static struct discovery *discovery_new(struct conn *conn, char **argvp)
+{
+	struct discovery *disc = g_new0(struct discovery, 1);
+
+	disc->conn = conn;
+	if (opt_cache_dir)
+		disc->cache_key = cache_key(argvp);
+
+	conn->discoveries = g_slist_prepend(conn->discoveries, disc);
+
+	return disc;
+}
+
+static void discovery_free(gpointer data)
+{
+	struct discovery *disc = data;
+
+	g_free(disc->cache_key);
+	g_free(disc);
+}
+
+static void discovery_begin(struct discovery *disc, const char *rsptype)
+{
+	resp_begin(disc->conn, rsptype);
+
+	if (disc->cache_key)
+		resp_record = g_string_new(NULL);
+}
+
+static void discovery_end(struct discovery *disc)
+{
+	struct conn *conn = disc->conn;
+
+	resp_end();
+
+	if (resp_record) {
+		cache_store(conn, disc->cache_key, g_strchug(resp_record->str));
+		g_string_free(resp_record, TRUE);
+		resp_record = NULL;
+	}
+
+	conn->discoveries = g_slist_remove(conn->discoveries, disc);
+	discovery_free(disc);
+}
+
+static void discovery_error(struct discovery *disc, const char *errcode)
 {
-	conn_state = st;
-	cmd_status(0, NULL);
+	struct conn *conn = disc->conn;
+
+	resp_error(conn, errcode);
+
+	conn->discoveries = g_slist_remove(conn->discoveries, disc);
+	discovery_free(disc);
 }
 
 static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
-	GAttrib *attrib = user_data;
+	struct conn *conn = user_data;
+	GAttrib *attrib = conn->attrib;
+	struct timespec rx_time;
 	uint8_t *opdu;
 	uint16_t handle, i, olen = 0;
 	size_t plen;
@@ -173,19 +714,28 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 	case ATT_OP_HANDLE_IND:
 		break;
 	default:
-		g_print("# Invalid opcode\n");
+		resp_comment("Invalid opcode");
 		return;
 	}
 
+	/* Arrival time (CLOCK_REALTIME) and count for each connection */
+	bt_att_get_rx_time(g_attrib_get_att(attrib), &rx_time);
+
 	assert( len >= 3 );
-	resp_begin( pdu[0]==ATT_OP_HANDLE_NOTIFY ? rsp_NOTIFY : rsp_IND );
+	resp_begin( conn, pdu[0]==ATT_OP_HANDLE_NOTIFY ? rsp_NOTIFY : rsp_IND );
 	send_uint( tag_HANDLE, handle );
 	send_data( pdu+3, len-3 );
+	send_uint( tag_TIME_SEC, rx_time.tv_sec );
+	send_uint( tag_TIME_NSEC, rx_time.tv_nsec );
+	send_uint( tag_SEQUENCE, conn->event_seq++ );
 	resp_end();
 
 	if (pdu[0] == ATT_OP_HANDLE_NOTIFY)
 		return;
 
+	if (handle == conn->svc_changed_hnd)
+		cache_invalidate(conn);
+
 	opdu = g_attrib_get_buffer(attrib, &plen);
 	olen = enc_confirmation(opdu, plen);
 
@@ -195,6 +745,7 @@ static void events_handler(const uint8_t *pdu, uint16_t len, gpointer user_data)
 
 static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t starting_handle, ending_handle, olen;
@@ -213,6 +764,7 @@ static void gatts_find_info_req(const uint8_t *pdu, uint16_t len, gpointer user_
 
 static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t starting_handle, ending_handle, att_type, olen;
@@ -232,6 +784,7 @@ static void gatts_find_by_type_req(const uint8_t *pdu, uint16_t len, gpointer us
 
 static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t starting_handle, ending_handle, att_type, olen;
@@ -253,6 +806,7 @@ static void gatts_read_by_type_req(const uint8_t *pdu, uint16_t len, gpointer us
 
 static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t handle, olen;
@@ -270,6 +824,7 @@ static void gatts_read_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 
 static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t handle, offset, olen;
@@ -288,6 +843,7 @@ static void gatts_read_blob_req(const uint8_t *pdu, uint16_t len, gpointer user_
 
 static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t handle1, handle2, offset, olen;
@@ -306,6 +862,7 @@ static void gatts_read_multi_req(const uint8_t *pdu, uint16_t len, gpointer user
 
 static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t starting_handle, ending_handle, att_group_type, olen;
@@ -325,6 +882,7 @@ static void gatts_read_by_group_req(const uint8_t *pdu, uint16_t len, gpointer u
 
 static void gatts_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t handle, olen;
@@ -362,6 +920,7 @@ static void gatts_signed_write_cmd(const uint8_t *pdu, uint16_t len, gpointer us
 
 static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode;
 	uint16_t handle, offset, olen;
@@ -380,6 +939,7 @@ static void gatts_prep_write_req(const uint8_t *pdu, uint16_t len, gpointer user
 
 static void gatts_exec_write_req(const uint8_t *pdu, uint16_t len, gpointer user_data)
 {
+	GAttrib *attrib = user_data;
 	uint8_t *opdu;
 	uint8_t opcode, flags;
 	uint16_t olen;
@@ -408,234 +968,1437 @@ static int strtohandle(const char *src)
 	return dst;
 }
 
+/* Decode a hex argument in place; returns its length, 0 if not valid hex */
+static size_t strtodata(char *src)
+{
+	ssize_t len;
+
+	len = gatt_attr_data_decode(src, (uint8_t *) src, strlen(src) / 2);
+
+	return len < 0 ? 0 : len;
+}
+
 static void exchange_mtu_cb(guint8 status, const guint8 *pdu, guint16 plen, gpointer user_data)
 {
+	struct conn *conn = user_data;
+	const char *err = NULL;
 	uint16_t mtu;
 
-	if (status != 0) {
-		resp_error(err_COMM_ERR); // Todo: status
+	if (status != 0)
+		err = err_COMM_ERR; // Todo: status
+	else if (!dec_mtu_resp(pdu, plen, &mtu))
+		err = err_PROTO_ERR;
+	else if (g_attrib_set_mtu(conn->attrib, MIN(mtu, conn->mtu_offered)))
+		/* Set new value for MTU in client */
+		conn->mtu = MIN(mtu, conn->mtu_offered);
+	else
+		err = err_COMM_ERR;
+
+	/* Exchanged as part of "conn": report the connection either way */
+	if (conn->state == STATE_CONNECTING) {
+		if (err)
+			resp_comment("Error exchanging MTU, using %d", conn->mtu);
+		set_state(conn, STATE_CONNECTED);
 		return;
 	}
 
-	if (!dec_mtu_resp(pdu, plen, &mtu)) {
-		resp_error(err_PROTO_ERR);
+	if (err) {
+		resp_comment("Error exchanging MTU");
+		resp_error(conn, err);
 		return;
 	}
 
-	mtu = MIN(mtu, opt_mtu);
-	/* Set new value for MTU in client */
-	if (g_attrib_set_mtu(attrib, mtu)) {
-		opt_mtu = mtu;
-		cmd_status(0, NULL);
-	} else {
-		printf("# Error exchanging MTU\n");
-		resp_error(err_COMM_ERR);
-	}
+	cmd_status(conn, 0, NULL);
 }
 
-static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen, gpointer user_data)
+/* Only one exchange is allowed per connection, by either side */
+static gboolean exchange_mtu(struct conn *conn, int mtu)
 {
-	if (status != 0) {
-		resp_error(err_COMM_ERR); // Todo: status
-		return;
-	}
+	conn->mtu_offered = MIN(mtu, ATT_MAX_LE_MTU);
 
-	if (!dec_write_resp(pdu, plen) && !dec_exec_write_resp(pdu, plen)) {
-		resp_error(err_PROTO_ERR);
-		return;
+	return gatt_exchange_mtu(conn->attrib, conn->mtu_offered,
+						exchange_mtu_cb, conn) != 0;
+}
+
+/*
+ * While reconnect is on, Client Characteristic Configuration values that
+ * are written are kept, to be written back after a reconnect. A two-byte
+ * write that could be one is checked with a Find Information request for
+ * its handle, so other attributes are never written behind the user's back.
+ */
+enum subscription_kind {
+	SUB_UNKNOWN,
+	SUB_CCCD,
+	SUB_OTHER
+};
+
+struct subscription {
+	uint16_t handle;
+	uint16_t value;
+	enum subscription_kind kind;
+};
+
+static struct subscription *subscription_find(struct conn *conn,
+							uint16_t handle)
+{
+	GSList *l;
+
+	for (l = conn->subscriptions; l; l = l->next) {
+		struct subscription *sub = l->data;
+
+		if (sub->handle == handle)
+			return sub;
 	}
 
-	resp_begin(rsp_WRITE);
-	resp_end();
+	return NULL;
 }
 
-static void cmd_char_write_common(int argcp, char **argvp, int with_response)
+static void subscription_check_cb(uint8_t status, GSList *descs,
+							void *user_data)
 {
-	uint8_t *value;
+	struct conn *conn = user_data;
+	GSList *l;
+
+	if (status)
+		return;
+
+	for (l = descs; l; l = l->next) {
+		struct gatt_desc *desc = l->data;
+		struct subscription *sub;
+
+		sub = subscription_find(conn, desc->handle);
+		if (!sub)
+			continue;
+
+		if (desc->uuid16 == GATT_CLIENT_CHARAC_CFG_UUID)
+			sub->kind = SUB_CCCD;
+		else
+			sub->kind = SUB_OTHER;
+	}
+}
+
+/* Called for each value written by wr, wrr and batch */
+static void subscription_note(struct conn *conn, uint16_t handle,
+					const uint8_t *value, size_t len)
+{
+	struct subscription *sub;
+	uint16_t val;
+
+	if (!conn->reconn_max || len != 2)
+		return;
+
+	/* Notifications and/or indications, or neither */
+	val = get_le16(value);
+	if (val > 0x0003)
+		return;
+
+	sub = subscription_find(conn, handle);
+	if (!sub) {
+		if (!val)
+			return;
+
+		sub = g_new0(struct subscription, 1);
+		sub->handle = handle;
+		sub->kind = SUB_UNKNOWN;
+		conn->subscriptions = g_slist_prepend(conn->subscriptions, sub);
+	}
+
+	sub->value = val;
+
+	if (sub->kind == SUB_UNKNOWN)
+		gatt_discover_desc(conn->attrib, handle, handle, NULL,
+					subscription_check_cb, conn);
+}
+
+static void subscription_restore_cb(guint8 status, const guint8 *pdu,
+					guint16 plen, gpointer user_data)
+{
+	if (status)
+		resp_comment("Can't restore subscription: %s",
+						att_ecode2str(status));
+}
+
+static void subscriptions_restore(struct conn *conn)
+{
+	uint8_t value[2];
+	GSList *l;
+
+	for (l = conn->subscriptions; l; l = l->next) {
+		struct subscription *sub = l->data;
+
+		if (sub->kind != SUB_CCCD || !sub->value)
+			continue;
+
+		put_le16(sub->value, value);
+		gatt_write_char(conn->attrib, sub->handle, value, sizeof(value),
+					subscription_restore_cb, conn);
+	}
+}
+
+static void subscriptions_free(struct conn *conn)
+{
+	g_slist_free_full(conn->subscriptions, g_free);
+	conn->subscriptions = NULL;
+}
+
+static void char_write_req_cb(guint8 status, const guint8 *pdu, guint16 plen, gpointer user_data)
+{
+	struct conn *conn = user_data;
+
+	if (status != 0) {
+		resp_error(conn, err_COMM_ERR); // Todo: status
+		return;
+	}
+
+	if (!dec_write_resp(pdu, plen) && !dec_exec_write_resp(pdu, plen)) {
+		resp_error(conn, err_PROTO_ERR);
+		return;
+	}
+
+	resp_begin(conn, rsp_WRITE);
+	resp_end();
+}
+
+static void cmd_char_write_common(struct conn *conn, int argcp, char **argvp,
+							int with_response)
+{
+	uint8_t *value;
 	size_t plen;
 	int handle;
 
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
 	if (argcp < 3) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
 	handle = strtohandle(argvp[1]);
 	if (handle <= 0) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	plen = gatt_attr_data_from_string(argvp[2], &value);
+	value = (uint8_t *) argvp[2];
+	plen = strtodata(argvp[2]);
 	if (plen == 0) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
+	subscription_note(conn, handle, value, plen);
+
 	if (with_response) {
-		gatt_write_char(attrib, handle, value, plen, char_write_req_cb, NULL);
+		gatt_write_char(conn->attrib, handle, value, plen,
+						char_write_req_cb, conn);
 	} else {
-		gatt_write_char(attrib, handle, value, plen, NULL, NULL);
-		resp_begin(rsp_WRITE);
+		gatt_write_char(conn->attrib, handle, value, plen, NULL, NULL);
+		resp_begin(conn, rsp_WRITE);
 		resp_end();
 	}
-
-	g_free(value);
 }
 
 static void char_read_cb(guint8 status, const guint8 *pdu, guint16 plen, gpointer user_data)
 {
+	struct conn *conn = user_data;
 	uint8_t value[plen];
 	ssize_t vlen;
 
 	if (status != 0) {
-		resp_error(err_COMM_ERR); // Todo: status
+		resp_error(conn, err_COMM_ERR); // Todo: status
 		return;
 	}
 
 	vlen = dec_read_resp(pdu, plen, value, sizeof(value));
 	if (vlen < 0) {
-		resp_error(err_COMM_ERR);
+		resp_error(conn, err_COMM_ERR);
 		return;
 	}
 
-	resp_begin(rsp_READ);
+	resp_begin(conn, rsp_READ);
 	send_data(value, vlen);
 	resp_end();
 }
 
+static void char_read_multi_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct conn *conn = user_data;
+	uint8_t values[plen];
+	ssize_t vlen;
+
+	if (status != 0) {
+		resp_error(conn, err_COMM_ERR); // Todo: status
+		return;
+	}
+
+	vlen = dec_read_multi_resp(pdu, plen, values, sizeof(values));
+	if (vlen < 0) {
+		resp_error(conn, err_COMM_ERR);
+		return;
+	}
+
+	resp_begin(conn, rsp_READ_MULTI);
+	send_data(values, vlen);
+	resp_end();
+}
+
+/*
+ * A batch carries several reads and writes in one command line. All of its
+ * requests are queued at once and a single "batch" response reports each
+ * item's handle, ATT status and data, in command order.
+ */
+struct batch_item {
+	struct batch *batch;
+	uint16_t handle;
+	uint8_t status;
+	uint8_t *data;
+	size_t len;
+};
+
+struct batch {
+	struct conn *conn;
+	unsigned int pending;
+	unsigned int n_items;
+	struct batch_item items[0];
+};
+
+static void batch_free(gpointer data)
+{
+	struct batch *batch = data;
+	unsigned int i;
+
+	for (i = 0; i < batch->n_items; i++)
+		g_free(batch->items[i].data);
+
+	g_free(batch);
+}
+
+static void batch_done(struct batch *batch)
+{
+	struct conn *conn = batch->conn;
+	struct batch_item *item;
+	unsigned int i;
+
+	if (--batch->pending > 0)
+		return;
+
+	resp_begin(conn, rsp_BATCH);
+	for (i = 0; i < batch->n_items; i++) {
+		item = &batch->items[i];
+		send_uint(tag_HANDLE, item->handle);
+		send_uint(tag_ATT_STATUS, item->status);
+		send_data(item->data, item->len);
+	}
+	resp_end();
+
+	conn->batches = g_slist_remove(conn->batches, batch);
+	batch_free(batch);
+}
+
+static void batch_read_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct batch_item *item = user_data;
+	ssize_t vlen;
+
+	item->status = status;
+	if (status == 0) {
+		item->data = g_malloc(plen);
+		vlen = dec_read_resp(pdu, plen, item->data, plen);
+		if (vlen < 0)
+			item->status = ATT_ECODE_INVALID_PDU;
+		else
+			item->len = vlen;
+	}
+
+	batch_done(item->batch);
+}
+
+static void batch_write_cb(guint8 status, const guint8 *pdu, guint16 plen,
+							gpointer user_data)
+{
+	struct batch_item *item = user_data;
+
+	item->status = status;
+	if (status == 0 && !dec_write_resp(pdu, plen) &&
+					!dec_exec_write_resp(pdu, plen))
+		item->status = ATT_ECODE_INVALID_PDU;
+
+	batch_done(item->batch);
+}
+
+/*
+ * A streamed write sends a long value to one handle as MTU-sized Write
+ * Commands. At most STREAM_WINDOW of them are queued in bt_att at a time;
+ * the destroy notify of each fires once it has been written to the socket,
+ * and queues the next. The socket send buffer thus paces the stream without
+ * a round trip per chunk, and one "wrs" response reports the elapsed time.
+ */
+#define STREAM_WINDOW	32
+
+struct stream {
+	struct conn *conn;	/* NULL once the connection has gone */
+	uint16_t handle;
+	uint8_t *data;
+	size_t len;
+	size_t offset;		/* Next byte to queue */
+	size_t chunk;
+	unsigned int in_flight;
+	unsigned int chunks;
+	gboolean failed;
+	gint64 start;
+};
+
+static void stream_free(struct stream *stream)
+{
+	g_free(stream->data);
+	g_free(stream);
+}
+
+static void stream_sent(gpointer user_data);
+
+static void stream_fill(struct stream *stream)
+{
+	struct conn *conn = stream->conn;
+	size_t n;
+
+	while (stream->in_flight < STREAM_WINDOW &&
+					stream->offset < stream->len) {
+		n = MIN(stream->chunk, stream->len - stream->offset);
+		if (!gatt_write_cmd(conn->attrib, stream->handle,
+					stream->data + stream->offset, n,
+					stream_sent, stream)) {
+			stream->failed = TRUE;
+			break;
+		}
+
+		stream->in_flight++;
+		stream->offset += n;
+		stream->chunks++;
+	}
+}
+
+static void stream_sent(gpointer user_data)
+{
+	struct stream *stream = user_data;
+	struct conn *conn = stream->conn;
+
+	stream->in_flight--;
+
+	if (!conn) {
+		if (stream->in_flight == 0)
+			stream_free(stream);
+		return;
+	}
+
+	if (!stream->failed)
+		stream_fill(stream);
+
+	if (stream->in_flight > 0)
+		return;
+
+	conn->streams = g_slist_remove(conn->streams, stream);
+
+	if (stream->failed) {
+		resp_error(conn, err_COMM_ERR);
+	} else {
+		resp_begin(conn, rsp_STREAM);
+		send_uint(tag_HANDLE, stream->handle);
+		send_uint(tag_LENGTH, stream->len);
+		send_uint(tag_CHUNKS, stream->chunks);
+		send_uint(tag_ELAPSED_US,
+				g_get_monotonic_time() - stream->start);
+		resp_end();
+	}
+
+	stream_free(stream);
+}
+
+/* Leave streams to be freed by the destroy notify of their last chunk */
+static void stream_detach(gpointer data)
+{
+	struct stream *stream = data;
+
+	stream->conn = NULL;
+	if (stream->in_flight == 0)
+		stream_free(stream);
+}
+
 static void char_desc_cb(uint8_t status, GSList *descriptors, void *user_data)
 {
+	struct discovery *disc = user_data;
 	GSList *l;
 
 	if (status) {
-		resp_error(err_COMM_ERR); // Todo: status
+		discovery_error(disc, err_COMM_ERR); // Todo: status
 		return;
 	}
 
-	resp_begin(rsp_DESCRIPTORS);
+	discovery_begin(disc, rsp_DESCRIPTORS);
 	for (l = descriptors; l; l = l->next) {
 		struct gatt_desc *desc = l->data;
 		send_uint(tag_HANDLE, desc->handle);
 		send_str(tag_UUID, desc->uuid);
 	}
+	discovery_end(disc);
+}
+
+static void char_cb(uint8_t status, GSList *characteristics, void *user_data)
+{
+	struct discovery *disc = user_data;
+	struct conn *conn = disc->conn;
+	bt_uuid_t svc_changed, uuid;
+	GSList *l;
+
+	if (status) {
+		discovery_error(disc, err_COMM_ERR); // Todo: status
+		return;
+	}
+
+	bt_uuid16_create(&svc_changed, GATT_CHARAC_SERVICE_CHANGED);
+
+	discovery_begin(disc, rsp_DISCOVERY);
+	for (l = characteristics; l; l = l->next) {
+		struct gatt_char *chars = l->data;
+		send_uint(tag_HANDLE, chars->handle);
+		send_uint(tag_PROPERTIES, chars->properties);
+		send_uint(tag_VALUE_HANDLE, chars->value_handle);
+		send_str(tag_UUID, chars->uuid);
+
+		if (bt_string_to_uuid(&uuid, chars->uuid) == 0 &&
+				bt_uuid_cmp(&uuid, &svc_changed) == 0)
+			conn->svc_changed_hnd = chars->value_handle;
+	}
+	discovery_end(disc);
+
+	if (opt_cache_dir && conn->svc_changed_hnd) {
+		char value[8];
+
+		snprintf(value, sizeof(value), "%X", conn->svc_changed_hnd);
+		cache_store(conn, "svcchg", value);
+	}
+}
+
+static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data)
+{
+	struct discovery *disc = user_data;
+	GSList *l;
+
+	if (status) {
+		discovery_error(disc, err_COMM_ERR); // Todo: status
+		return;
+	}
+
+	discovery_begin(disc, rsp_DISCOVERY);
+	for (l = ranges; l; l = l->next) {
+		struct att_range *range = l->data;
+		send_uint(tag_RANGE_START, range->start);
+		send_uint(tag_RANGE_END, range->end);
+	}
+	discovery_end(disc);
+}
+
+static void primary_all_cb(uint8_t status, GSList *services, void *user_data)
+{
+	struct discovery *disc = user_data;
+	GSList *l;
+
+	if (status) {
+		discovery_error(disc, err_COMM_ERR); // Todo: status
+		return;
+	}
+
+	discovery_begin(disc, rsp_DISCOVERY);
+	for (l = services; l; l = l->next) {
+		struct gatt_primary *prim = l->data;
+		send_uint(tag_RANGE_START, prim->range.start);
+		send_uint(tag_RANGE_END, prim->range.end);
+		send_str(tag_UUID, prim->uuid);
+	}
+	discovery_end(disc);
+}
+
+/*
+ * LE scanning runs on the default adapter's HCI socket. The controller's
+ * own duplicate filter is left off, since it drops changes in advertising
+ * data; instead the hash of the last payload is kept for each address and
+ * report type, and a report is passed on only when it differs. New reports
+ * are collected and sent as one "scan" response per batch interval. The
+ * table is emptied if it reaches SCAN_SEEN_MAX addresses (private
+ * addresses change every few minutes), so those devices are reported again.
+ */
+#define SCAN_BATCH_MS		200
+#define SCAN_BATCH_MAX		64
+#define SCAN_SEEN_MAX		4096
+
+struct scan_key {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t evt_type;
+	uint32_t hash;		/* Of the last payload, not part of the key */
+};
+
+struct scan_report {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint8_t evt_type;
+	int8_t rssi;
+	uint8_t len;
+	uint8_t data[HCI_MAX_EIR_LENGTH];
+};
+
+struct scan {
+	struct conn *conn;
+	int dd;
+	struct io *io;
+	unsigned int flush_id;
+	GHashTable *seen;
+	unsigned int n_pending;
+	struct scan_report pending[SCAN_BATCH_MAX];
+};
+
+static struct scan *scan;
+
+static guint scan_key_hash(gconstpointer key)
+{
+	const struct scan_key *k = key;
+
+	return get_le32(&k->bdaddr.b[0]) ^ k->bdaddr.b[4] << 8 ^
+				k->bdaddr.b[5] << 16 ^ k->evt_type << 24;
+}
+
+static gboolean scan_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct scan_key *ka = a, *kb = b;
+
+	return ka->evt_type == kb->evt_type &&
+				ka->bdaddr_type == kb->bdaddr_type &&
+				!bacmp(&ka->bdaddr, &kb->bdaddr);
+}
+
+static void scan_flush(void)
+{
+	unsigned int i;
+
+	if (scan->n_pending == 0)
+		return;
+
+	resp_begin(scan->conn, rsp_SCAN);
+	for (i = 0; i < scan->n_pending; i++) {
+		struct scan_report *r = &scan->pending[i];
+		char addr[18];
+
+		ba2str(&r->bdaddr, addr);
+		send_str(tag_ADDR, addr);
+		send_uint(tag_ADDR_TYPE, r->bdaddr_type);
+		send_uint(tag_ADV_TYPE, r->evt_type);
+		send_uint(tag_RSSI, (uint8_t) r->rssi);
+		send_data(r->data, r->len);
+	}
 	resp_end();
+
+	scan->n_pending = 0;
+}
+
+static bool scan_flush_cb(void *user_data)
+{
+	scan_flush();
+
+	return true;
+}
+
+static void scan_report(le_advertising_info *info, int8_t rssi)
+{
+	struct scan_key key, *seen;
+	struct scan_report *r;
+	uint32_t hash = 2166136261u;
+	int i;
+
+	/* FNV-1a over the payload */
+	for (i = 0; i < info->length; i++)
+		hash = (hash ^ info->data[i]) * 16777619u;
+
+	memset(&key, 0, sizeof(key));
+	bacpy(&key.bdaddr, &info->bdaddr);
+	key.bdaddr_type = info->bdaddr_type;
+	key.evt_type = info->evt_type;
+
+	seen = g_hash_table_lookup(scan->seen, &key);
+	if (seen) {
+		if (seen->hash == hash)
+			return;
+		seen->hash = hash;
+	} else {
+		if (g_hash_table_size(scan->seen) >= SCAN_SEEN_MAX)
+			g_hash_table_remove_all(scan->seen);
+
+		key.hash = hash;
+		seen = g_memdup(&key, sizeof(key));
+		g_hash_table_insert(scan->seen, seen, seen);
+	}
+
+	r = &scan->pending[scan->n_pending++];
+	bacpy(&r->bdaddr, &info->bdaddr);
+	r->bdaddr_type = info->bdaddr_type;
+	r->evt_type = info->evt_type;
+	r->rssi = rssi;
+	r->len = MIN(info->length, sizeof(r->data));
+	memcpy(r->data, info->data, r->len);
+
+	if (scan->n_pending == SCAN_BATCH_MAX)
+		scan_flush();
+}
+
+static bool scan_read_cb(struct io *io, void *user_data)
+{
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	evt_le_meta_event *meta;
+	uint8_t *ptr, *end;
+	uint8_t n;
+	ssize_t len;
+
+	len = read(scan->dd, buf, sizeof(buf));
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE + 1)
+		return true;
+
+	meta = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+	if (meta->subevent != EVT_LE_ADVERTISING_REPORT)
+		return true;
+
+	end = buf + len;
+	n = meta->data[0];
+	ptr = meta->data + 1;
+
+	while (n-- > 0 && ptr + LE_ADVERTISING_INFO_SIZE <= end) {
+		le_advertising_info *info = (void *) ptr;
+
+		/* RSSI follows the data */
+		if (info->data + info->length + 1 > end)
+			break;
+
+		scan_report(info, (int8_t) info->data[info->length]);
+		ptr = info->data + info->length + 1;
+	}
+
+	return true;
+}
+
+static void scan_stop(void)
+{
+	if (!scan)
+		return;
+
+	hci_le_set_scan_enable(scan->dd, 0x00, 0x00, 1000);
+
+	scan_flush();
+
+	if (scan->flush_id)
+		timeout_remove(scan->flush_id);
+
+	io_destroy(scan->io);
+	hci_close_dev(scan->dd);
+
+	g_hash_table_destroy(scan->seen);
+
+	g_free(scan);
+	scan = NULL;
+}
+
+static void cmd_scan(struct conn *conn, int argcp, char **argvp)
+{
+	struct hci_filter filter;
+	uint8_t scan_type = 0x00;
+	int batch_ms = SCAN_BATCH_MS;
+	int dev_id, dd;
+
+	if (scan) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	if (argcp > 1) {
+		if (strcasecmp(argvp[1], "active") == 0)
+			scan_type = 0x01;
+		else if (strcasecmp(argvp[1], "passive") != 0) {
+			resp_error(conn, err_BAD_PARAM);
+			return;
+		}
+	}
+
+	if (argcp > 2) {
+		batch_ms = strtohandle(argvp[2]);
+		if (batch_ms <= 0) {
+			resp_error(conn, err_BAD_PARAM);
+			return;
+		}
+	}
+
+	dev_id = hci_get_route(NULL);
+	dd = dev_id < 0 ? -1 : hci_open_dev(dev_id);
+	if (dd < 0) {
+		resp_comment("Can't open HCI device: %s", strerror(errno));
+		resp_error(conn, err_COMM_ERR);
+		return;
+	}
+
+	/* In case a previous user left the adapter scanning */
+	hci_le_set_scan_enable(dd, 0x00, 0x00, 1000);
+
+	if (hci_le_set_scan_parameters(dd, scan_type, htobs(0x0010),
+					htobs(0x0010), LE_PUBLIC_ADDRESS,
+					0x00, 1000) < 0 ||
+			hci_le_set_scan_enable(dd, 0x01, 0x00, 1000) < 0) {
+		resp_comment("Can't start scan: %s", strerror(errno));
+		resp_error(conn, err_COMM_ERR);
+		hci_close_dev(dd);
+		return;
+	}
+
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter));
+
+	scan = g_new0(struct scan, 1);
+	scan->conn = conn;
+	scan->dd = dd;
+	scan->seen = g_hash_table_new_full(scan_key_hash, scan_key_equal,
+								g_free, NULL);
+	scan->io = io_new(dd);
+	io_set_read_handler(scan->io, scan_read_cb, NULL, NULL);
+	scan->flush_id = timeout_add(batch_ms, scan_flush_cb, NULL, NULL);
+
+	resp_begin(conn, rsp_SCAN);
+	resp_end();
+}
+
+static void cmd_scan_end(struct conn *conn, int argcp, char **argvp)
+{
+	if (!scan || scan->conn != conn) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	scan_stop();
+
+	resp_begin(conn, rsp_SCAN_END);
+	resp_end();
+}
+
+/*
+ * Connection parameter updates are sent to the controller of the adapter
+ * the link is on. The controller applies them at a connection event of
+ * its choosing, several intervals later (seconds, for long intervals), so
+ * the command is not waited for: an HCI socket is watched for its Command
+ * Status and the LE Connection Update Complete event, and "stat" is sent
+ * with the parameters the link ends up with.
+ */
+#define PARAM_UPDATE_TIMEOUT_MS	40000
+
+struct param_preset {
+	const char *name;
+	uint16_t min;		/* Interval, 1.25 ms units */
+	uint16_t max;
+	uint16_t latency;	/* Connection events */
+	uint16_t timeout;	/* Supervision timeout, 10 ms units */
+};
+
+static const struct param_preset param_presets[] = {
+	/* 7.5 to 11.25 ms, for streaming sensors and HID */
+	{ "low-latency",	0x0006, 0x0009, 0, 100 },
+	/* 15 to 30 ms, leaving room for many packets per event */
+	{ "bulk",		0x000c, 0x0018, 0, 400 },
+	/* 0.8 to 1 s, for mostly idle devices */
+	{ "power-save",		0x0280, 0x0320, 0, 600 },
+	{ NULL }
+};
+
+struct param_update {
+	int dd;
+	uint16_t handle;
+	struct io *io;
+	unsigned int timeout_id;
+};
+
+/* Ranges from the LE Connection Update command */
+static gboolean param_valid(int min, int max, int latency, int timeout)
+{
+	if (min < 0x0006 || max > 0x0c80 || min > max)
+		return FALSE;
+
+	if (latency < 0 || latency > 0x01f3)
+		return FALSE;
+
+	if (timeout < 0x000a || timeout > 0x0c80)
+		return FALSE;
+
+	/* The link must survive the peripheral skipping 'latency' events */
+	return timeout * 4 > (1 + latency) * max;
+}
+
+static void param_update_free(struct conn *conn)
+{
+	struct param_update *update = conn->param_update;
+
+	if (!update)
+		return;
+
+	if (update->timeout_id)
+		timeout_remove(update->timeout_id);
+
+	io_destroy(update->io);
+	hci_close_dev(update->dd);
+
+	g_free(update);
+	conn->param_update = NULL;
+}
+
+static void param_update_done(struct conn *conn, uint8_t status)
+{
+	param_update_free(conn);
+
+	if (status) {
+		resp_comment("Connection update failed: status 0x%02x", status);
+		resp_error(conn, err_COMM_ERR);
+		return;
+	}
+
+	cmd_status(conn, 0, NULL);
+}
+
+static bool param_update_read_cb(struct io *io, void *user_data)
+{
+	struct conn *conn = user_data;
+	struct param_update *update = conn->param_update;
+	uint8_t buf[HCI_MAX_EVENT_SIZE];
+	evt_le_connection_update_complete *evt;
+	evt_le_meta_event *meta;
+	evt_cmd_status *cs;
+	hci_event_hdr *hdr;
+	ssize_t len;
+
+	len = read(update->dd, buf, sizeof(buf));
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE)
+		return true;
+
+	hdr = (void *) (buf + 1);
+
+	if (hdr->evt == EVT_CMD_STATUS) {
+		if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_CMD_STATUS_SIZE)
+			return true;
+
+		cs = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+		if (cs->opcode != htobs(cmd_opcode_pack(OGF_LE_CTL,
+						OCF_LE_CONN_UPDATE)) ||
+								!cs->status)
+			return true;
+
+		param_update_done(conn, cs->status);
+		return false;
+	}
+
+	if (len < 1 + HCI_EVENT_HDR_SIZE + EVT_LE_META_EVENT_SIZE +
+					EVT_LE_CONN_UPDATE_COMPLETE_SIZE)
+		return true;
+
+	meta = (void *) (buf + 1 + HCI_EVENT_HDR_SIZE);
+	if (meta->subevent != EVT_LE_CONN_UPDATE_COMPLETE)
+		return true;
+
+	evt = (void *) meta->data;
+	if (btohs(evt->handle) != update->handle)
+		return true;
+
+	if (!evt->status) {
+		conn->conn_interval = btohs(evt->interval);
+		conn->conn_latency = btohs(evt->latency);
+		conn->conn_timeout = btohs(evt->supervision_timeout);
+	}
+
+	param_update_done(conn, evt->status);
+
+	return false;
+}
+
+static bool param_update_timeout_cb(void *user_data)
+{
+	struct conn *conn = user_data;
+
+	conn->param_update->timeout_id = 0;
+	param_update_free(conn);
+
+	resp_comment("Connection update timed out");
+	resp_error(conn, err_COMM_ERR);
+
+	return false;
+}
+
+static void cmd_conn_param(struct conn *conn, int argcp, char **argvp)
+{
+	const struct param_preset *preset;
+	struct param_update *update;
+	le_connection_update_cp cp;
+	struct hci_filter filter;
+	int min, max, latency, timeout;
+	GError *gerr = NULL;
+	uint16_t handle;
+	bdaddr_t src;
+	char addr[18];
+	int dev_id, dd;
+
+	if (conn->state != STATE_CONNECTED || conn->param_update) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	if (argcp == 2) {
+		for (preset = param_presets; preset->name; preset++) {
+			if (strcasecmp(argvp[1], preset->name) == 0)
+				break;
+		}
+
+		if (!preset->name) {
+			resp_error(conn, err_BAD_PARAM);
+			return;
+		}
+
+		min = preset->min;
+		max = preset->max;
+		latency = preset->latency;
+		timeout = preset->timeout;
+	} else if (argcp == 5) {
+		min = strtohandle(argvp[1]);
+		max = strtohandle(argvp[2]);
+		latency = strtohandle(argvp[3]);
+		timeout = strtohandle(argvp[4]);
+	} else {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	if (!param_valid(min, max, latency, timeout)) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	bt_io_get(conn->iochannel, &gerr, BT_IO_OPT_HANDLE, &handle,
+				BT_IO_OPT_SOURCE_BDADDR, &src,
+				BT_IO_OPT_INVALID);
+	if (gerr) {
+		resp_comment("Can't get connection handle: %s", gerr->message);
+		resp_error(conn, err_COMM_ERR);
+		g_error_free(gerr);
+		return;
+	}
+
+	ba2str(&src, addr);
+	dev_id = hci_devid(addr);
+	dd = dev_id < 0 ? -1 : hci_open_dev(dev_id);
+	if (dd < 0) {
+		resp_comment("Can't open HCI device: %s", strerror(errno));
+		resp_error(conn, err_COMM_ERR);
+		return;
+	}
+
+	/* Filter first, so that a quick Command Status is not missed */
+	hci_filter_clear(&filter);
+	hci_filter_set_ptype(HCI_EVENT_PKT, &filter);
+	hci_filter_set_event(EVT_CMD_STATUS, &filter);
+	hci_filter_set_event(EVT_LE_META_EVENT, &filter);
+	setsockopt(dd, SOL_HCI, HCI_FILTER, &filter, sizeof(filter));
+
+	memset(&cp, 0, sizeof(cp));
+	cp.handle = htobs(handle);
+	cp.min_interval = htobs(min);
+	cp.max_interval = htobs(max);
+	cp.latency = htobs(latency);
+	cp.supervision_timeout = htobs(timeout);
+	cp.min_ce_length = htobs(0x0001);
+	cp.max_ce_length = htobs(0x0001);
+
+	if (hci_send_cmd(dd, OGF_LE_CTL, OCF_LE_CONN_UPDATE,
+					LE_CONN_UPDATE_CP_SIZE, &cp) < 0) {
+		resp_comment("Can't update connection: %s", strerror(errno));
+		resp_error(conn, err_COMM_ERR);
+		hci_close_dev(dd);
+		return;
+	}
+
+	update = g_new0(struct param_update, 1);
+	update->dd = dd;
+	update->handle = handle;
+	update->io = io_new(dd);
+	io_set_read_handler(update->io, param_update_read_cb, conn, NULL);
+	update->timeout_id = timeout_add(PARAM_UPDATE_TIMEOUT_MS,
+					param_update_timeout_cb, conn, NULL);
+
+	conn->param_update = update;
+}
+
+/*
+ * The controller takes one LE Create Connection at a time; a second
+ * connect on the same adapter fails with EBUSY on older kernels and
+ * waits its turn on newer ones. Either way, connects are started here
+ * one at a time and the rest are queued, reporting "tryconn" meanwhile.
+ * So that a device that is out of range does not hold up the others for
+ * the whole kernel timeout, an attempt that has run CONNECT_SLOT_MS while
+ * others wait is cancelled and queued again behind them. An attempt fails
+ * once it has had CONNECT_TIMEOUT_MS in all, whether or not others wait,
+ * as older kernels may never time it out themselves.
+ */
+#define CONNECT_SLOT_MS		4000
+#define CONNECT_TIMEOUT_MS	20000
+
+static struct queue *connect_queue;
+static struct conn *connecting_conn;
+static unsigned int connect_slot_id;
+
+static void connect_cb(GIOChannel *io, GError *err, gpointer user_data);
+static void disconnect_io(struct conn *conn);
+
+/*
+ * Closing the socket also cancels a connect still in progress. btio is
+ * still watching that socket, and the fd must not be closed under its
+ * watch: the next connect would likely get the same number.
+ */
+static void close_channel(struct conn *conn)
+{
+	if (conn == connecting_conn) {
+		int fd = g_io_channel_unix_get_fd(conn->iochannel);
+
+#ifdef MAINLOOP_EPOLL
+		mainloop_remove_fd(fd);
+#else
+		/*
+		 * Ends the connect; btio's watch then fires, finds no conn
+		 * for the channel and drops the last reference, closing fd
+		 */
+		shutdown(fd, SHUT_RDWR);
+		g_io_channel_unref(conn->iochannel);
+		conn->iochannel = NULL;
+		return;
+#endif
+	}
+
+	g_io_channel_shutdown(conn->iochannel, FALSE, NULL);
+	g_io_channel_unref(conn->iochannel);
+	conn->iochannel = NULL;
+}
+
+static bool connect_slot_cb(void *user_data);
+static void reconnect_schedule(struct conn *conn);
+
+static void connect_start(struct conn *conn)
+{
+	GError *gerr = NULL;
+
+	conn->iochannel = gatt_connect(opt_src, conn->dst, conn->dst_type,
+					conn->sec_level, opt_psm, conn->mtu,
+					connect_cb, &gerr);
+
+	if (conn->iochannel == NULL) {
+		resp_comment("%s", gerr->message);
+		g_error_free(gerr);
+		if (conn->reconn_tries)
+			reconnect_schedule(conn);
+		else
+			set_state(conn, STATE_DISCONNECTED);
+		return;
+	}
+
+	connecting_conn = conn;
+	connect_slot_id = timeout_add(CONNECT_SLOT_MS, connect_slot_cb,
+								NULL, NULL);
+}
+
+static void connect_next(void)
+{
+	struct conn *conn;
+
+	if (quitting)
+		return;
+
+	while (!connecting_conn && (conn = queue_pop_head(connect_queue)))
+		connect_start(conn);
+}
+
+/* The attempt in progress for conn has finished, one way or the other */
+static void connect_done(struct conn *conn)
+{
+	if (conn != connecting_conn)
+		return;
+
+	connecting_conn = NULL;
+
+	if (connect_slot_id) {
+		timeout_remove(connect_slot_id);
+		connect_slot_id = 0;
+	}
+
+	connect_next();
+}
+
+static bool connect_slot_cb(void *user_data)
+{
+	struct conn *conn = connecting_conn;
+
+	conn->connect_ms += CONNECT_SLOT_MS;
+
+	if (conn->connect_ms < CONNECT_TIMEOUT_MS && queue_isempty(connect_queue))
+		return true;
+
+	connect_slot_id = 0;
+
+	if (conn->connect_ms >= CONNECT_TIMEOUT_MS && conn->reconn_tries) {
+		resp_comment("Reconnect error: no connection after %d ms",
+							conn->connect_ms);
+		close_channel(conn);
+		connecting_conn = NULL;
+		reconnect_schedule(conn);
+		connect_next();
+		return false;
+	}
+
+	if (conn->connect_ms >= CONNECT_TIMEOUT_MS) {
+		disconnect_io(conn);
+		resp_error(conn, err_CONN_FAIL);
+		resp_comment("Connect error: no connection after %d ms",
+							conn->connect_ms);
+		return false;
+	}
+
+	close_channel(conn);
+	connecting_conn = NULL;
+	queue_push_tail(connect_queue, conn);
+	connect_next();
+
+	return false;
+}
+
+/*
+ * With "reconn <n>", a connection whose link drops is reconnected by the
+ * helper, up to n times: first at once, then backing off from
+ * RECONNECT_BACKOFF_MS to RECONNECT_BACKOFF_MAX_MS between attempts. Each
+ * attempt is reported as "stat" with state tryconn and the attempt number
+ * in "reconn", and the last as conn or disc. Security level and MTU are
+ * asked for again as before, and subscriptions are restored (see
+ * subscription_note), so notifications resume without any commands.
+ */
+#define RECONNECT_BACKOFF_MS		250
+#define RECONNECT_BACKOFF_MAX_MS	8000
+
+static bool reconnect_cb(void *user_data)
+{
+	struct conn *conn = user_data;
+
+	conn->reconn_id = 0;
+	conn->connect_ms = 0;
+
+	if (connecting_conn)
+		queue_push_tail(connect_queue, conn);
+	else
+		connect_start(conn);
+
+	return false;
 }
 
-static void char_cb(uint8_t status, GSList *characteristics, void *user_data)
+static void reconnect_schedule(struct conn *conn)
 {
-	GSList *l;
+	int delay;
 
-	if (status) {
-		resp_error(err_COMM_ERR); // Todo: status
+	if (conn->reconn_tries >= conn->reconn_max) {
+		resp_comment("Reconnect failed after %d attempts",
+							conn->reconn_tries);
+		subscriptions_free(conn);
+		set_state(conn, STATE_DISCONNECTED);
 		return;
 	}
 
-	resp_begin(rsp_DISCOVERY);
-	for (l = characteristics; l; l = l->next) {
-		struct gatt_char *chars = l->data;
-		send_uint(tag_HANDLE, chars->handle);
-		send_uint(tag_PROPERTIES, chars->properties);
-		send_uint(tag_VALUE_HANDLE, chars->value_handle);
-		send_str(tag_UUID, chars->uuid);
+	/* The first attempt at once (the main loop's next iteration) */
+	if (conn->reconn_tries == 0)
+		delay = 1;
+	else
+		delay = MIN(RECONNECT_BACKOFF_MS <<
+					MIN(conn->reconn_tries - 1, 5),
+					RECONNECT_BACKOFF_MAX_MS);
+
+	conn->reconn_tries++;
+	set_state(conn, STATE_CONNECTING);
+
+	conn->reconn_id = timeout_add(delay, reconnect_cb, conn, NULL);
+}
+
+/* Releases everything that belongs to the link itself */
+static void link_down(struct conn *conn)
+{
+	if (conn->disconn_id) {
+		bt_att_unregister_disconnect(g_attrib_get_att(conn->attrib),
+							conn->disconn_id);
+		conn->disconn_id = 0;
 	}
-	resp_end();
+
+	g_slist_free_full(conn->streams, stream_detach);
+	conn->streams = NULL;
+
+	param_update_free(conn);
+	conn->conn_interval = 0;
+	conn->conn_latency = 0;
+	conn->conn_timeout = 0;
+
+	g_attrib_unref(conn->attrib);
+	conn->attrib = NULL;
+	conn->mtu = 0;
+	conn->mtu_offered = 0;
+	conn->event_seq = 0;
+
+	/* Requests still queued were cancelled along with the attrib */
+	g_slist_free_full(conn->batches, batch_free);
+	conn->batches = NULL;
+	g_slist_free_full(conn->discoveries, discovery_free);
+	conn->discoveries = NULL;
+
+	close_channel(conn);
 }
 
-static void primary_by_uuid_cb(uint8_t status, GSList *ranges, void *user_data)
+static void disconnect_io(struct conn *conn)
 {
-	GSList *l;
+	if (conn->state == STATE_DISCONNECTED)
+		return;
 
-	if (status) {
-		resp_error(err_COMM_ERR); // Todo: status
+	subscriptions_free(conn);
+	conn->reconn_tries = 0;
+
+	/* Waiting to reconnect: no link, nothing queued */
+	if (conn->reconn_id) {
+		timeout_remove(conn->reconn_id);
+		conn->reconn_id = 0;
+		set_state(conn, STATE_DISCONNECTED);
 		return;
 	}
 
-	resp_begin(rsp_DISCOVERY);
-	for (l = ranges; l; l = l->next) {
-		struct att_range *range = l->data;
-		send_uint(tag_RANGE_START, range->start);
-		send_uint(tag_RANGE_END, range->end);
+	if (queue_remove(connect_queue, conn)) {
+		set_state(conn, STATE_DISCONNECTED);
+		return;
 	}
-	resp_end();
+
+	link_down(conn);
+
+	set_state(conn, STATE_DISCONNECTED);
+	connect_done(conn);
 }
 
-static void primary_all_cb(uint8_t status, GSList *services, void *user_data)
+static struct conn *conn_new(unsigned int id)
 {
-	GSList *l;
+	struct conn *conn = g_new0(struct conn, 1);
 
-	if (status) {
-		resp_error(err_COMM_ERR); // Todo: status
-		return;
-	}
+	conn->id = id;
+	conn->state = STATE_DISCONNECTED;
+	conn->sec_level = g_strdup("low");
+	conn->dst_type = g_strdup("public");
 
-	resp_begin(rsp_DISCOVERY);
-	for (l = services; l; l = l->next) {
-		struct gatt_primary *prim = l->data;
-		send_uint(tag_RANGE_START, prim->range.start);
-		send_uint(tag_RANGE_END, prim->range.end);
-		send_str(tag_UUID, prim->uuid);
-	}
-	resp_end();
+	g_hash_table_insert(conns, GUINT_TO_POINTER(id), conn);
+
+	return conn;
 }
 
-static void disconnect_io()
+static void conn_free(gpointer data)
 {
-	if (conn_state == STATE_DISCONNECTED)
-		return;
+	struct conn *conn = data;
+
+	disconnect_io(conn);
+	subscriptions_free(conn);
 
-	g_attrib_unref(attrib);
-	attrib = NULL;
-	opt_mtu = 0;
+	if (scan && scan->conn == conn)
+		scan_stop();
+
+	g_free(conn->dst);
+	g_free(conn->dst_type);
+	g_free(conn->sec_level);
+	g_free(conn);
+}
 
-	g_io_channel_shutdown(iochannel, FALSE, NULL);
-	g_io_channel_unref(iochannel);
-	iochannel = NULL;
+static gboolean match_conn_io(gpointer key, gpointer value, gpointer user_data)
+{
+	struct conn *conn = value;
 
-	set_state(STATE_DISCONNECTED);
+	return conn->iochannel == user_data;
 }
 
-static gboolean channel_watcher(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+static void disconnect_cb(int err, void *user_data)
 {
-	disconnect_io();
+	struct conn *conn = user_data;
+
+	conn->disconn_id = 0;
+
+	if (conn->reconn_max && (conn->state == STATE_CONNECTED ||
+						conn->reconn_tries)) {
+		resp_comment("Link lost: %s", strerror(err));
+		link_down(conn);
+		reconnect_schedule(conn);
+		return;
+	}
 
-	return FALSE;
+	disconnect_io(conn);
 }
 
 static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 {
+	struct conn *conn;
+	GAttrib *attrib;
+	gboolean mtu_pending;
 	uint16_t mtu;
-    uint16_t cid;
+	uint16_t cid;
 	GError *gerr = NULL;
 
+	conn = g_hash_table_find(conns, match_conn_io, io);
+	if (!conn)
+		return;
+
+	connect_done(conn);
+
+	if (err && conn->reconn_tries) {
+		resp_comment("Reconnect error: %s", err->message);
+		close_channel(conn);
+		reconnect_schedule(conn);
+		return;
+	}
+
 	if (err) {
-		set_state(STATE_DISCONNECTED);
-		resp_error(err_CONN_FAIL);
-		printf("# Connect error: %s\n", err->message);
+		set_state(conn, STATE_DISCONNECTED);
+		resp_error(conn, err_CONN_FAIL);
+		resp_comment("Connect error: %s", err->message);
 		return;
 	}
 
 	bt_io_get(io, &gerr, BT_IO_OPT_IMTU, &mtu, BT_IO_OPT_CID, &cid, BT_IO_OPT_INVALID);
 
 	if (gerr) {
-		printf("# Can't detect MTU, using default: %s\n", gerr->message);
+		resp_comment("Can't detect MTU, using default: %s", gerr->message);
 		g_error_free(gerr);
-	    mtu = ATT_DEFAULT_LE_MTU;
+		mtu = ATT_DEFAULT_LE_MTU;
 	}
 
 	if (cid == ATT_CID)
 		mtu = ATT_DEFAULT_LE_MTU;
 
-	opt_mtu = mtu;
+	conn->mtu = mtu;
 
-	attrib = g_attrib_new(iochannel, opt_mtu);
-	g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES, events_handler, attrib, NULL);
-	g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES, events_handler, attrib, NULL);
+	attrib = g_attrib_new(conn->iochannel, conn->mtu);
+	conn->attrib = attrib;
+	conn->disconn_id = bt_att_register_disconnect(g_attrib_get_att(attrib),
+						disconnect_cb, conn, NULL);
+	g_attrib_register(attrib, ATT_OP_HANDLE_NOTIFY, GATTRIB_ALL_HANDLES, events_handler, conn, NULL);
+	g_attrib_register(attrib, ATT_OP_HANDLE_IND, GATTRIB_ALL_HANDLES, events_handler, conn, NULL);
 	g_attrib_register(attrib, ATT_OP_FIND_INFO_REQ, GATTRIB_ALL_HANDLES, gatts_find_info_req, attrib, NULL);
 	g_attrib_register(attrib, ATT_OP_FIND_BY_TYPE_REQ, GATTRIB_ALL_HANDLES, gatts_find_by_type_req, attrib, NULL);
 	g_attrib_register(attrib, ATT_OP_READ_BY_TYPE_REQ, GATTRIB_ALL_HANDLES, gatts_read_by_type_req, attrib, NULL);
@@ -649,46 +2412,67 @@ static void connect_cb(GIOChannel *io, GError *err, gpointer user_data)
 	g_attrib_register(attrib, ATT_OP_PREP_WRITE_REQ, GATTRIB_ALL_HANDLES, gatts_prep_write_req, attrib, NULL);
 	g_attrib_register(attrib, ATT_OP_EXEC_WRITE_REQ, GATTRIB_ALL_HANDLES, gatts_exec_write_req, attrib, NULL);
 
-	set_state(STATE_CONNECTED);
+	cache_load(conn);
+
+	/* Long reads and writes pick up the new MTU from the attrib buffer */
+	mtu_pending = conn->conn_mtu > ATT_DEFAULT_LE_MTU &&
+					exchange_mtu(conn, conn->conn_mtu);
+
+	/* Queued behind the MTU exchange */
+	if (conn->reconn_tries)
+		subscriptions_restore(conn);
+
+	if (mtu_pending)
+		return;
+
+	set_state(conn, STATE_CONNECTED);
 }
 
-static void cmd_mtu(int argcp, char **argvp)
+static void cmd_mtu(struct conn *conn, int argcp, char **argvp)
 {
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	int mtu;
+
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
 	assert(!opt_psm);
 
 	if (argcp < 2) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	if (opt_mtu) {
-		resp_error(err_BAD_STATE);
+	if (conn->mtu_offered) {
+		resp_error(conn, err_BAD_STATE);
 		/* Can only set once per connection */
 		return;
 	}
 
 	errno = 0;
-	opt_mtu = strtoll(argvp[1], NULL, 16);
-	if (errno != 0 || opt_mtu < ATT_DEFAULT_LE_MTU) {
-		resp_error(err_BAD_PARAM);
+	mtu = strtoll(argvp[1], NULL, 16);
+	if (errno != 0 || mtu < ATT_DEFAULT_LE_MTU) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	if (!exchange_mtu(conn, mtu)) {
+		resp_error(conn, err_COMM_ERR);
 		return;
 	}
 
-	gatt_exchange_mtu(attrib, opt_mtu, exchange_mtu_cb, NULL);
+	/* Offered again if the helper reconnects */
+	conn->conn_mtu = mtu;
 }
 
-static void cmd_sec_level(int argcp, char **argvp)
+static void cmd_sec_level(struct conn *conn, int argcp, char **argvp)
 {
 	GError *gerr = NULL;
 	BtIOSecLevel sec_level;
 
 	if (argcp < 2) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
@@ -699,80 +2483,246 @@ static void cmd_sec_level(int argcp, char **argvp)
 	else if (strcasecmp(argvp[1], "low") == 0)
 		sec_level = BT_IO_SEC_LOW;
 	else {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	g_free(opt_sec_level);
-	opt_sec_level = g_strdup(argvp[1]);
+	g_free(conn->sec_level);
+	conn->sec_level = g_strdup(argvp[1]);
 
-	if (conn_state != STATE_CONNECTED)
+	if (conn->state != STATE_CONNECTED)
 		return;
 
 	assert(!opt_psm);
 
-	bt_io_set(iochannel, &gerr,
+	bt_io_set(conn->iochannel, &gerr,
 			BT_IO_OPT_SEC_LEVEL, sec_level,
 			BT_IO_OPT_INVALID);
 	if (gerr) {
-		printf("# Error: %s\n", gerr->message);
-                resp_error(err_COMM_ERR);
+		resp_comment("Error: %s", gerr->message);
+		resp_error(conn, err_COMM_ERR);
 		g_error_free(gerr);
 	} else {
 		/* Tell bluepy the security level
 		 * has been changed successfuly */
-		cmd_status(0, NULL);
+		cmd_status(conn, 0, NULL);
 	}
 }
 
-static void cmd_char_write(int argcp, char **argvp)
+static void cmd_char_write(struct conn *conn, int argcp, char **argvp)
 {
-  cmd_char_write_common(argcp, argvp, 0);
+	cmd_char_write_common(conn, argcp, argvp, 0);
 }
 
-static void cmd_char_write_rsp(int argcp, char **argvp)
+static void cmd_char_write_rsp(struct conn *conn, int argcp, char **argvp)
 {
-  cmd_char_write_common(argcp, argvp, 1);
+	cmd_char_write_common(conn, argcp, argvp, 1);
 }
 
-static void cmd_read_hnd(int argcp, char **argvp)
+static void cmd_read_hnd(struct conn *conn, int argcp, char **argvp)
 {
 	int handle;
 
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
 	if (argcp < 2) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
 	handle = strtohandle(argvp[1]);
 
 	if (handle < 0) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	gatt_read_char(conn->attrib, handle, char_read_cb, conn);
+}
+
+static void cmd_read_multi(struct conn *conn, int argcp, char **argvp)
+{
+	uint16_t handles[argcp];
+	int handle;
+	int i;
+
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	if (argcp < 3) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	for (i = 1; i < argcp; i++) {
+		handle = strtohandle(argvp[i]);
+		if (handle <= 0) {
+			resp_error(conn, err_BAD_PARAM);
+			return;
+		}
+		handles[i - 1] = handle;
+	}
+
+	/* Fails if the handles do not fit in one request */
+	if (!gatt_read_char_multi(conn->attrib, handles, argcp - 1,
+						char_read_multi_cb, conn))
+		resp_error(conn, err_BAD_PARAM);
+}
+
+static void cmd_batch(struct conn *conn, int argcp, char **argvp)
+{
+	struct batch *batch;
+	struct batch_item *item;
+	uint8_t *value;
+	size_t plen;
+	int handle;
+	int i, n;
+
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	/* Validate the whole batch before queueing any of it */
+	for (i = 1, n = 0; i < argcp; n++) {
+		int nargs;
+
+		if (strcasecmp(argvp[i], "rd") == 0)
+			nargs = 2;
+		else if (strcasecmp(argvp[i], "wr") == 0 ||
+					strcasecmp(argvp[i], "wrr") == 0)
+			nargs = 3;
+		else
+			break;
+
+		if (i + nargs > argcp || strtohandle(argvp[i + 1]) <= 0)
+			break;
+
+		i += nargs;
+	}
+
+	if (i < argcp || n == 0) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	batch = g_malloc0(sizeof(*batch) + n * sizeof(struct batch_item));
+	batch->conn = conn;
+	batch->n_items = n;
+	/* Hold one extra count so that no reply is sent while queueing */
+	batch->pending = n + 1;
+	conn->batches = g_slist_prepend(conn->batches, batch);
+
+	for (i = 1, n = 0; n < batch->n_items; n++) {
+		item = &batch->items[n];
+		item->batch = batch;
+		item->handle = handle = strtohandle(argvp[i + 1]);
+
+		/* A request that could not be queued gets no callback */
+		if (strcasecmp(argvp[i], "rd") == 0) {
+			if (!gatt_read_char(conn->attrib, handle,
+							batch_read_cb, item)) {
+				item->status = ATT_ECODE_UNLIKELY;
+				batch_done(batch);
+			}
+			i += 2;
+			continue;
+		}
+
+		value = (uint8_t *) argvp[i + 2];
+		plen = strtodata(argvp[i + 2]);
+		if (plen == 0) {
+			item->status = ATT_ECODE_INVAL_ATTR_VALUE_LEN;
+			batch_done(batch);
+		} else if (strcasecmp(argvp[i], "wrr") == 0) {
+			subscription_note(conn, handle, value, plen);
+			if (!gatt_write_char(conn->attrib, handle, value, plen,
+							batch_write_cb, item)) {
+				item->status = ATT_ECODE_UNLIKELY;
+				batch_done(batch);
+			}
+		} else {
+			subscription_note(conn, handle, value, plen);
+			if (!gatt_write_char(conn->attrib, handle, value, plen,
+								NULL, NULL))
+				item->status = ATT_ECODE_UNLIKELY;
+			batch_done(batch);
+		}
+
+		i += 3;
+	}
+
+	batch_done(batch);
+}
+
+static void cmd_char_write_stream(struct conn *conn, int argcp, char **argvp)
+{
+	struct stream *stream;
+	size_t buflen, len;
+	int handle;
+
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
+		return;
+	}
+
+	if (argcp < 3) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	handle = strtohandle(argvp[1]);
+	if (handle <= 0) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
+	}
+
+	len = strtodata(argvp[2]);
+	if (len == 0) {
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	gatt_read_char(attrib, handle, char_read_cb, attrib);
+	stream = g_new0(struct stream, 1);
+	stream->data = g_memdup(argvp[2], len);
+	stream->len = len;
+
+	/* Each Write Command carries opcode and handle along with the data */
+	g_attrib_get_buffer(conn->attrib, &buflen);
+	stream->chunk = buflen - 3;
+	stream->conn = conn;
+	stream->handle = handle;
+	stream->start = g_get_monotonic_time();
+	conn->streams = g_slist_prepend(conn->streams, stream);
+
+	stream_fill(stream);
+
+	if (stream->in_flight == 0) {
+		conn->streams = g_slist_remove(conn->streams, stream);
+		stream_free(stream);
+		resp_error(conn, err_COMM_ERR);
+	}
 }
 
-static void cmd_char_desc(int argcp, char **argvp)
+static void cmd_char_desc(struct conn *conn, int argcp, char **argvp)
 {
 	int start = 0x0001;
 	int end = 0xffff;
 
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
 	if (argcp > 1) {
 		start = strtohandle(argvp[1]);
 		if (start < 0) {
-			resp_error(err_BAD_PARAM);
+			resp_error(conn, err_BAD_PARAM);
 			return;
 		}
 	}
@@ -780,28 +2730,32 @@ static void cmd_char_desc(int argcp, char **argvp)
 	if (argcp > 2) {
 		end = strtohandle(argvp[2]);
 		if (end < 0) {
-			resp_error(err_BAD_PARAM);
+			resp_error(conn, err_BAD_PARAM);
 			return;
 		}
 	}
 
-	gatt_discover_desc(attrib, start, end, NULL, char_desc_cb, NULL);
+	if (cache_replay(conn, rsp_DESCRIPTORS, argvp))
+		return;
+
+	gatt_discover_desc(conn->attrib, start, end, NULL, char_desc_cb,
+						discovery_new(conn, argvp));
 }
 
-static void cmd_char(int argcp, char **argvp)
+static void cmd_char(struct conn *conn, int argcp, char **argvp)
 {
 	int start = 0x0001;
 	int end = 0xffff;
 
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
 	if (argcp > 1) {
 		start = strtohandle(argvp[1]);
 		if (start < 0) {
-			resp_error(err_BAD_PARAM);
+			resp_error(conn, err_BAD_PARAM);
 			return;
 		}
 	}
@@ -809,7 +2763,7 @@ static void cmd_char(int argcp, char **argvp)
 	if (argcp > 2) {
 		end = strtohandle(argvp[2]);
 		if (end < 0) {
-			resp_error(err_BAD_PARAM);
+			resp_error(conn, err_BAD_PARAM);
 			return;
 		}
 	}
@@ -818,222 +2772,488 @@ static void cmd_char(int argcp, char **argvp)
 		bt_uuid_t uuid;
 
 		if (bt_string_to_uuid(&uuid, argvp[3]) < 0) {
-			resp_error(err_BAD_PARAM);
+			resp_error(conn, err_BAD_PARAM);
 			return;
 		}
 
-		gatt_discover_char(attrib, start, end, &uuid, char_cb, NULL);
+		if (cache_replay(conn, rsp_DISCOVERY, argvp))
+			return;
+
+		gatt_discover_char(conn->attrib, start, end, &uuid, char_cb,
+						discovery_new(conn, argvp));
 		return;
 	}
 
-	gatt_discover_char(attrib, start, end, NULL, char_cb, NULL);
+	if (cache_replay(conn, rsp_DISCOVERY, argvp))
+		return;
+
+	gatt_discover_char(conn->attrib, start, end, NULL, char_cb,
+						discovery_new(conn, argvp));
 }
 
-static void cmd_primary(int argcp, char **argvp)
+static void cmd_primary(struct conn *conn, int argcp, char **argvp)
 {
 	bt_uuid_t uuid;
 
-	if (conn_state != STATE_CONNECTED) {
-		resp_error(err_BAD_STATE);
+	if (conn->state != STATE_CONNECTED) {
+		resp_error(conn, err_BAD_STATE);
 		return;
 	}
 
+	if (cache_replay(conn, rsp_DISCOVERY, argvp))
+		return;
+
 	if (argcp == 1) {
-		gatt_discover_primary(attrib, NULL, primary_all_cb, NULL);
+		gatt_discover_primary(conn->attrib, NULL, primary_all_cb,
+						discovery_new(conn, argvp));
 		return;
 	}
 
 	if (bt_string_to_uuid(&uuid, argvp[1]) < 0) {
-		resp_error(err_BAD_PARAM);
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	gatt_discover_primary(attrib, &uuid, primary_by_uuid_cb, NULL);
+	gatt_discover_primary(conn->attrib, &uuid, primary_by_uuid_cb,
+						discovery_new(conn, argvp));
 }
 
-static void cmd_disconnect(int argcp, char **argvp)
+static void cmd_disconnect(struct conn *conn, int argcp, char **argvp)
 {
-	disconnect_io();
+	if (conn->state == STATE_DISCONNECTED)
+		cmd_status(conn, 0, NULL);
+	else
+		disconnect_io(conn);
+
+	/* Connection 0 keeps its settings, as it did before tagging */
+	if (conn->id != 0)
+		g_hash_table_remove(conns, GUINT_TO_POINTER(conn->id));
 }
 
-static void cmd_connect(int argcp, char **argvp)
+static void cmd_connect(struct conn *conn, int argcp, char **argvp)
 {
-	GError *gerr = NULL;
-
-	if (conn_state != STATE_DISCONNECTED)
+	if (conn->state != STATE_DISCONNECTED)
 		return;
 
 	if (argcp > 1) {
-		g_free(opt_dst);
-		opt_dst = g_strdup(argvp[1]);
+		g_free(conn->dst);
+		conn->dst = g_strdup(argvp[1]);
 
-		g_free(opt_dst_type);
+		g_free(conn->dst_type);
 		if (argcp > 2)
-			opt_dst_type = g_strdup(argvp[2]);
+			conn->dst_type = g_strdup(argvp[2]);
 		else
-			opt_dst_type = g_strdup("public");
+			conn->dst_type = g_strdup("public");
+
+		conn->conn_mtu = 0;
+		if (argcp > 3) {
+			conn->conn_mtu = strtohandle(argvp[3]);
+			if (conn->conn_mtu < ATT_DEFAULT_LE_MTU) {
+				resp_error(conn, err_BAD_PARAM);
+				return;
+			}
+		}
 	}
 
-	if (opt_dst == NULL) {
-		resp_error(err_BAD_PARAM);
+	if (conn->dst == NULL) {
+		resp_error(conn, err_BAD_PARAM);
 		return;
 	}
 
-	set_state(STATE_CONNECTING);
-	iochannel = gatt_connect(opt_src, opt_dst, opt_dst_type, opt_sec_level, opt_psm, opt_mtu, connect_cb, &gerr);
+	conn->connect_ms = 0;
+	set_state(conn, STATE_CONNECTING);
 
-	if (iochannel == NULL) {
-		printf("%s\n", gerr->message);
-		set_state(STATE_DISCONNECTED);
-		g_error_free(gerr);
-	} else {
-		g_io_add_watch(iochannel, G_IO_HUP, channel_watcher, NULL);
+	if (connecting_conn)
+		queue_push_tail(connect_queue, conn);
+	else
+		connect_start(conn);
+}
+
+static void cmd_reconnect(struct conn *conn, int argcp, char **argvp)
+{
+	int max;
+
+	if (argcp < 2 || (max = strtohandle(argvp[1])) < 0) {
+		resp_error(conn, err_BAD_PARAM);
+		return;
 	}
+
+	conn->reconn_max = max;
+	if (!max)
+		subscriptions_free(conn);
+
+	cmd_status(conn, 0, NULL);
+}
+
+static void cmd_output_stats(struct conn *conn, int argcp, char **argvp)
+{
+	resp_begin(conn, rsp_OUTPUT_STATS);
+	send_uint(tag_RESPONSES, output_stats.responses);
+	send_uint(tag_FLUSHES, output_stats.flushes);
+	send_uint(tag_MAX_BATCH, output_stats.max_per_flush);
+	resp_end();
 }
 
-static void cmd_exit(int argcp, char **argvp)
+static void loop_quit(void)
 {
+	quitting = TRUE;
+#ifdef MAINLOOP_EPOLL
+	mainloop_quit();
+#else
 	g_main_loop_quit(event_loop);
+#endif
+}
+
+static void cmd_exit(struct conn *conn, int argcp, char **argvp)
+{
+	loop_quit();
 }
 
-static void cmd_status(int argcp, char **argvp)
+static void cmd_status(struct conn *conn, int argcp, char **argvp)
 {
-	resp_begin(rsp_STATUS);
-	switch(conn_state)
+	resp_begin(conn, rsp_STATUS);
+	switch(conn->state)
 	{
 		case STATE_CONNECTING:
 			send_sym(tag_CONNSTATE, st_CONNECTING);
-			send_str(tag_DEVICE, opt_dst);
+			send_str(tag_DEVICE, conn->dst);
 			break;
 		case STATE_CONNECTED:
 			send_sym(tag_CONNSTATE, st_CONNECTED);
-			send_str(tag_DEVICE, opt_dst);
+			send_str(tag_DEVICE, conn->dst);
 			break;
 		default:
 			send_sym(tag_CONNSTATE, st_DISCONNECTED);
 			break;
 	}
 
-	send_uint(tag_MTU, opt_mtu);
-	send_str(tag_SEC_LEVEL, opt_sec_level);
+	send_uint(tag_MTU, conn->mtu);
+	send_str(tag_SEC_LEVEL, conn->sec_level);
+
+	if (conn->reconn_tries)
+		send_uint(tag_RECONNECT, conn->reconn_tries);
+
+	if (conn->conn_interval) {
+		send_uint(tag_INTERVAL, conn->conn_interval);
+		send_uint(tag_LATENCY, conn->conn_latency);
+		send_uint(tag_SUPERVISION, conn->conn_timeout);
+	}
+
 	resp_end();
 }
 
 static struct {
 	const char *cmd;
-	void (*func)(int argcp, char **argvp);
+	void (*func)(struct conn *conn, int argcp, char **argvp);
 	const char *params;
 	const char *desc;
 } commands[] = {
 	{ "help",	cmd_help,		"",				"Show this help"},
 	{ "stat",	cmd_status,		"",				"Show current status" },
+	{ "ostat",	cmd_output_stats,	"",				"Show responses written and write() calls" },
 	{ "quit",	cmd_exit,		"",				"Exit interactive mode" },
-	{ "conn",	cmd_connect,		"[address [address type]]",	"Connect to a remote device" },
+	{ "conn",	cmd_connect,		"[address [address type [mtu]]]",	"Connect to a remote device" },
 	{ "disc",	cmd_disconnect,		"",				"Disconnect from a remote device" },
+	{ "reconn",	cmd_reconnect,		"<attempts>",			"Reconnect after a drop, 0 for never" },
 	{ "svcs",	cmd_primary,		"[UUID]",			"Primary Service Discovery" },
 	{ "char",	cmd_char,		"[start hnd [end hnd [UUID]]]",	"Characteristics Discovery" },
 	{ "desc",	cmd_char_desc,		"[start hnd] [end hnd]",	"Characteristics Descriptor Discovery" },
 	{ "rd",		cmd_read_hnd,		"<handle>",			"Characteristics Value/Descriptor Read by handle" },
+	{ "rdm",	cmd_read_multi,		"<handle> <handle>...",		"Characteristics Value Read Multiple" },
 	{ "wrr",	cmd_char_write_rsp,	"<handle> <new value>",		"Characteristic Value Write (Write Request)" },
 	{ "wr",		cmd_char_write,		"<handle> <new value>",		"Characteristic Value Write (No response)" },
+	{ "wrs",	cmd_char_write_stream,	"<handle> <value>",		"Stream a long value as Write Commands" },
+	{ "batch",	cmd_batch,		"<rd|wr|wrr hnd [value]>...",	"Batched reads/writes, one response" },
 	{ "secu",	cmd_sec_level,		"[low | medium | high]",	"Set security level. Default: low" },
+	{ "scan",	cmd_scan,		"[passive | active] [batch ms, hex]",	"Start LE scan, reporting new advertisements" },
+	{ "scanend",	cmd_scan_end,		"",				"Stop LE scan" },
 	{ "mtu",	cmd_mtu,		"<value>",			"Exchange MTU for GATT/ATT" },
+	{ "connparam",	cmd_conn_param,		"<preset | min max lat tmo>",	"Update connection interval, latency and timeout" },
 	{ NULL,		NULL,			NULL,				NULL}
 };
 
-static void cmd_help(int argcp, char **argvp)
+static void cmd_help(struct conn *conn, int argcp, char **argvp)
 {
 	int i;
 
+	resp_comment("%-15s %-30s %s", "@<id> <cmd>", "", "Send command for connection <id>");
 	for (i = 0; commands[i].cmd; i++)
-		printf("#%-15s %-30s %s\n", commands[i].cmd, commands[i].params, commands[i].desc);
+		resp_comment("%-15s %-30s %s", commands[i].cmd, commands[i].params, commands[i].desc);
 
-	cmd_status(0, NULL);
+	cmd_status(conn, 0, NULL);
 }
 
-static void parse_line(char *line_read)
+/*
+ * Commands are looked up in an open-addressed hash of commands[], built
+ * once at startup. Slots hold the command's index plus one, 0 if empty.
+ */
+#define CMD_HASH_SIZE	64
+
+static int cmd_index[CMD_HASH_SIZE];
+
+static unsigned int cmd_hash(const char *name)
 {
-	gchar **argvp;
-	int argcp;
+	unsigned int hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (uint8_t) g_ascii_tolower(*name)) * 16777619;
+
+	return hash;
+}
+
+static void cmd_index_init(void)
+{
+	unsigned int hash;
 	int i;
 
-	line_read = g_strstrip(line_read);
+	for (i = 0; commands[i].cmd; i++) {
+		hash = cmd_hash(commands[i].cmd);
+		while (cmd_index[hash % CMD_HASH_SIZE])
+			hash++;
+		cmd_index[hash % CMD_HASH_SIZE] = i + 1;
+	}
+}
 
-	if (*line_read == '\0')
-		goto done;
+static int cmd_lookup(const char *name)
+{
+	unsigned int hash = cmd_hash(name);
+	int i;
 
-	g_shell_parse_argv(line_read, &argcp, &argvp, NULL);
+	for (; (i = cmd_index[hash % CMD_HASH_SIZE]); hash++)
+		if (strcasecmp(commands[i - 1].cmd, name) == 0)
+			return i - 1;
 
-	for (i = 0; commands[i].cmd; i++)
-		if (strcasecmp(commands[i].cmd, argvp[0]) == 0)
+	return -1;
+}
+
+/*
+ * Input is read into a buffer that lives as long as the helper, and each
+ * line is split into arguments in place, so that a stream of commands
+ * costs no allocations once the buffers have grown to fit. Arguments are
+ * separated by whitespace and may be quoted with ' or ".
+ */
+#define INPUT_CHUNK	4096
+
+static struct {
+	char *data;
+	size_t len;
+	size_t size;
+} input;
+
+static char **args;
+static int args_size;
+
+static int split_args(char *line)
+{
+	char *p = line;
+	char quote;
+	int argc = 0;
+
+	for (;;) {
+		while (g_ascii_isspace(*p))
+			p++;
+
+		if (*p == '\0')
 			break;
 
-	if (commands[i].cmd)
-		commands[i].func(argcp, argvp);
-	else
-		resp_error(err_BAD_CMD);
+		/* Room for this argument and the terminating NULL */
+		if (argc + 2 > args_size) {
+			args_size = MAX(16, args_size * 2);
+			args = g_renew(char *, args, args_size);
+		}
+
+		if (*p == '\'' || *p == '"') {
+			quote = *p++;
+			args[argc++] = p;
+			p = strchrnul(p, quote);
+		} else {
+			args[argc++] = p;
+			while (*p != '\0' && !g_ascii_isspace(*p))
+				p++;
+		}
+
+		if (*p == '\0')
+			break;
 
-	g_strfreev(argvp);
+		*p++ = '\0';
+	}
+
+	if (args)
+		args[argc] = NULL;
 
-done:
-	free(line_read);
+	return argc;
 }
 
-static gboolean prompt_read(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+/* Commands that keep state on their connection, so may be the first to use it */
+static gboolean cmd_opens_conn(int i)
 {
-	gchar *myline;
-        GError *err;
+	return commands[i].func == cmd_connect ||
+		commands[i].func == cmd_sec_level ||
+		commands[i].func == cmd_reconnect ||
+		commands[i].func == cmd_scan;
+}
 
-	if ( cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL) )
-	{
-		g_io_channel_unref(chan);
-		return FALSE;
+static void parse_line(char *line)
+{
+	struct conn *conn;
+	char **argvp;
+	int argcp;
+	int i;
+	unsigned int id = 0;
+
+	argcp = split_args(line);
+	if (argcp == 0)
+		return;
+
+	argvp = args;
+
+	if (argvp[0][0] == '@') {
+		int cid = strtohandle(argvp[0] + 1);
+
+		if (cid < 0 || argcp < 2) {
+			resp_error(NULL, err_BAD_PARAM);
+			return;
+		}
+
+		id = cid;
+		argcp--;
+		argvp++;
 	}
 
-        if ( G_IO_STATUS_NORMAL != g_io_channel_read_line(chan, &myline, NULL, NULL, NULL) || myline == NULL )
-        {
-		printf("# Quitting on input read fail\n");
-		g_main_loop_quit(event_loop);
-		return FALSE;
-        }
+	i = cmd_lookup(argvp[0]);
 
-        parse_line(myline);
-	return TRUE;
+	/* Connection 0 always exists; others only once a command opens them */
+	conn = g_hash_table_lookup(conns, GUINT_TO_POINTER(id));
+	if (!conn && (id == 0 || (i >= 0 && cmd_opens_conn(i))))
+		conn = conn_new(id);
+
+	if (!conn)
+		resp_error(NULL, i >= 0 ? err_BAD_STATE : err_BAD_CMD);
+	else if (i >= 0)
+		commands[i].func(conn, argcp, argvp);
+	else
+		resp_error(conn, err_BAD_CMD);
+}
+
+static bool prompt_read(struct io *io, void *user_data)
+{
+	char *line, *end;
+	ssize_t n;
+
+	if (input.size - input.len < INPUT_CHUNK) {
+		input.size = MAX(input.size * 2, input.len + INPUT_CHUNK);
+		input.data = g_realloc(input.data, input.size);
+	}
+
+	n = read(io_get_fd(io), input.data + input.len,
+						input.size - input.len);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return true;
+
+	if (n <= 0) {
+		resp_comment("Quitting on input read fail");
+		loop_quit();
+		return false;
+	}
+
+	input.len += n;
+
+	/* Run every complete line, keeping any partial one for next time */
+	line = input.data;
+	while (!quitting &&
+			(end = memchr(line, '\n', input.data + input.len - line))) {
+		*end = '\0';
+		parse_line(line);
+		line = end + 1;
+	}
+
+	input.len -= line - input.data;
+	memmove(input.data, line, input.len);
+
+	return true;
+}
+
+/* Commands may arrive along with the hangup, so read until end of file */
+static bool prompt_hup(struct io *io, void *user_data)
+{
+	while (!quitting && prompt_read(io, user_data))
+		;
+
+	return false;
 }
 
 int main(int argc, char *argv[])
 {
-	GIOChannel *pchan;
-	gint events;
+	struct io *input_io;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "bc:")) != -1) {
+		switch (opt) {
+		case 'b':
+			opt_binary = TRUE;
+			break;
+		case 'c':
+			/* textfile needs an absolute path */
+			if (g_path_is_absolute(optarg)) {
+				opt_cache_dir = g_strdup(optarg);
+			} else {
+				gchar *cwd = g_get_current_dir();
+
+				opt_cache_dir = g_build_filename(cwd, optarg, NULL);
+				g_free(cwd);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-b] [-c cache dir]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	conns = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, conn_free);
+	cmd_index_init();
+	connect_queue = queue_new();
 
-	opt_sec_level = g_strdup("low");
-	opt_dst_type = g_strdup("public");
+#ifdef MAINLOOP_EPOLL
+	mainloop_init();
+#endif
+
+	output = ringbuf_new(OUTPUT_SIZE);
+	output_io = io_new(STDOUT_FILENO);
 
-	opt_src = NULL;
-	opt_dst = NULL;
+	resp_comment(__FILE__ " built at " __TIME__ " on " __DATE__);
 
-        printf("# " __FILE__ " built at " __TIME__ " on " __DATE__ "\n");
-        fflush(stdout);
+	input_io = io_new(STDIN_FILENO);
+	if (!input_io) {
+		fprintf(stderr, "Can't watch standard input\n");
+		return EXIT_FAILURE;
+	}
 
-	pchan = g_io_channel_unix_new(fileno(stdin));
-	g_io_channel_set_close_on_unref(pchan, TRUE);
-	events = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch(pchan, events, prompt_read, NULL);
+	io_set_read_handler(input_io, prompt_read, NULL, NULL);
+	io_set_disconnect_handler(input_io, prompt_hup, NULL, NULL);
 
+#ifdef MAINLOOP_EPOLL
+	mainloop_run();
+#else
 	event_loop = g_main_loop_new(NULL, FALSE);
 
 	g_main_loop_run(event_loop);
 
 	g_main_loop_unref(event_loop);
+#endif
 
-	cmd_disconnect(0, NULL);
-	fflush(stdout);
-	g_io_channel_unref(pchan);
+	g_hash_table_destroy(conns);
+	queue_destroy(connect_queue, NULL);
+	output_flush();
+	io_destroy(output_io);
+	ringbuf_free(output);
+	io_destroy(input_io);
 
 	g_free(opt_src);
-	g_free(opt_dst);
-	g_free(opt_sec_level);
-	g_free(opt_dst_type);
+	g_free(opt_cache_dir);
+	g_free(frame.data);
+	g_free(input.data);
+	g_free(args);
 
 	return EXIT_SUCCESS;
 }
@@ -7,9 +7,14 @@ import time
 import subprocess
 import binascii
 import select
+import struct
+import re
 
 Debugging = False
 helperExe = os.path.join(os.path.abspath(os.path.dirname(__file__)), "bluepy-helper")
+# Directory in which helpers started from now on keep discovery results
+# for each device; None disables the cache
+attributeCacheDir = None
 
 SEC_LEVEL_LOW = "low"
 SEC_LEVEL_MEDIUM = "medium"
@@ -18,6 +23,25 @@ SEC_LEVEL_HIGH = "high"
 ADDR_TYPE_PUBLIC = "public"
 ADDR_TYPE_RANDOM = "random"
 
+# Largest ATT MTU the helper will offer, for Peripheral(mtu=...)
+MAX_MTU = 517
+
+# Binary protocol frame and value types (see bluepy-helper.c)
+_FRAME_COMMENT = ord('#')
+_VAL_UINT = ord('h')
+_VAL_DATA = ord('b')
+
+# Notifications and indications are most of what the helper sends, so
+# their fixed layout is matched directly instead of by the generic parsers
+_NTFY_LINE = re.compile(br"rsp=\$(ntfy|ind)(?: id=h([0-9A-F]+))? hnd=h([0-9A-F]+) "
+                        br"d=b([0-9A-F]*) ts=h([0-9A-F]+) tns=h([0-9A-F]+) "
+                        br"seq=h([0-9A-F]+)\n")
+_NTFY_FRAME = b'R\x03rsp$\x04\x00ntfy'
+_IND_FRAME = b'R\x03rsp$\x03\x00ind'
+_U32 = struct.Struct('<I')
+_NTFY_HDR = struct.Struct('<5xI3xH')   # hnd, length of d
+_NTFY_TAIL = struct.Struct('<4xI5xI5xI')  # ts, tns, seq
+
 def DBG(*args):
     if Debugging:
         msg = " ".join([str(a) for a in args])
@@ -177,49 +201,353 @@ class DefaultDelegate:
     def handleNotification(self, cHandle, data):
         DBG("Notification:", cHandle, "sent data", binascii.b2a_hex(data))
 
+    def handleTimedNotification(self, cHandle, data, timestamp, seq):
+        # timestamp is when the notification reached the kernel, as
+        # time.time() would have given; seq counts the notifications and
+        # indications received on the connection, from 0
+        self.handleNotification(cHandle, data)
 
-class Peripheral:
-    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC):
-        self._helper = None
-        self._poller = None
-        self.services = {} # Indexed by UUID
-        self.addrType = addrType
-        self.discoveredAllServices = False
-        self.delegate = DefaultDelegate()
-        if deviceAddr is not None:
-            self.connect(deviceAddr, addrType)
+    def handleDiscovery(self, scanEntry, isNewDev, isNewData):
+        DBG("Discovered device", scanEntry.addr)
 
-    def setDelegate(self, delegate_):
-        self.delegate = delegate_
+    def handleReconnect(self, attempt, connected):
+        DBG("Reconnect attempt", attempt, "connected" if connected else "")
 
-    def _startHelper(self):
+
+def _deliverNotification(delegate, resp):
+    hnd = resp['hnd'][0]
+    data = resp['d'][0]
+    if 'ts' in resp and hasattr(delegate, 'handleTimedNotification'):
+        timestamp = resp['ts'][0] + resp['tns'][0] / 1e9
+        delegate.handleTimedNotification(hnd, data, timestamp, resp['seq'][0])
+    else:
+        delegate.handleNotification(hnd, data)
+
+
+class BluepyHelper:
+    """A running bluepy-helper process. One helper can be shared by several
+       Peripheral objects, each of which gets its own connection id."""
+
+    # Cleared by bench/ntfy-bench.py to time the generic parsers alone
+    _fastNotify = True
+
+    def __init__(self, binaryProtocol=False, notifyViews=False):
+        self._helper = None
+        self._poller = None
+        self._binary = binaryProtocol
+        self._views = notifyViews
+        self._viewBuf = memoryview(bytearray(MAX_MTU))
+        self._rxbuf = bytearray()
+        self._nextId = 1
+        self._conns = {}   # Peripheral objects, indexed by connection id
+        self._stopWhenIdle = False  # Set by connectMany() for its own helper
+        self._pending = {} # Responses not yet collected, indexed by connection id
+
+    def start(self):
         if self._helper is None:
             DBG("Running ", helperExe)
-            self._helper = subprocess.Popen([helperExe],
+            args = [helperExe]
+            if attributeCacheDir is not None:
+                args += ["-c", os.path.abspath(attributeCacheDir)]
+            if self._binary:
+                args += ["-b"]
+            self._helper = subprocess.Popen(args,
                                             stdin=subprocess.PIPE,
                                             stdout=subprocess.PIPE,
-                                            universal_newlines=True,
-                                            bufsize=1)
+                                            bufsize=0)
+            self._rxbuf = bytearray()
             self._poller = select.poll()
             self._poller.register(self._helper.stdout, select.POLLIN)
 
-    def _stopHelper(self):
+    def stop(self):
         if self._helper is not None:
             DBG("Stopping ", helperExe)
             self._poller.unregister(self._helper.stdout)
-            self._helper.stdin.write("quit\n")
-            self._helper.stdin.flush()
+            self.writeCmd("quit\n")
             self._helper.wait()
             self._helper = None
+            self._pending = {}
 
-    def _writeCmd(self, cmd):
+    def isRunning(self):
+        return self._helper is not None
+
+    def fileno(self):
+        # The helper's output; it becomes readable when processEvents()
+        # has something to do
+        if self._helper is None:
+            raise BTLEException(BTLEException.INTERNAL_ERROR,
+                                "Helper not started (did you call connect()?)")
+        return self._helper.stdout.fileno()
+
+    def attach(self, periph, connId=None):
+        if connId is None:
+            connId = self._nextId
+            self._nextId += 1
+        self._conns[connId] = periph
+        return connId
+
+    def detach(self, connId):
+        self._conns.pop(connId, None)
+        self._pending.pop(connId, None)
+        if self._stopWhenIdle and not self._conns:
+            self.stop()
+
+    def writeCmd(self, cmd):
         if self._helper is None:
             raise BTLEException(BTLEException.INTERNAL_ERROR,
                                 "Helper not started (did you call connect()?)")
         DBG("Sent: ", cmd)
-        self._helper.stdin.write(cmd)
+        self._helper.stdin.write(cmd.encode('utf-8'))
         self._helper.stdin.flush()
 
+    def _fill(self):
+        # Appends whatever the helper has written to the receive buffer,
+        # waiting for it if there is nothing yet
+        data = os.read(self._helper.stdout.fileno(), 65536)
+        if not data:
+            raise BTLEException(BTLEException.INTERNAL_ERROR, "Helper exited")
+        self._rxbuf.extend(data)
+
+    def _nextBuffered(self):
+        # Returns the next complete response in the receive buffer, or None
+        # if there is none. Comments from the helper are skipped.
+        buf = self._rxbuf
+        while True:
+            if self._binary:
+                if len(buf) < 4:
+                    return None
+                (flen,) = struct.unpack_from('<I', buf, 0)
+                end = 4 + flen
+                if len(buf) < end:
+                    return None
+                (ftype,) = struct.unpack_from('<B', buf, 4)
+                if ftype == _FRAME_COMMENT:
+                    DBG("Got: #", bytes(buf[5:end]).decode('utf-8'))
+                    resp = None
+                else:
+                    resp = self._notificationFrame(buf, end) if self._fastNotify else None
+                    if resp is None:
+                        resp = Peripheral.parseFrame(buf, 4, end)
+                    if Debugging:
+                        DBG("Got:", repr(resp))
+            else:
+                end = buf.find(b'\n') + 1
+                if end == 0:
+                    return None
+                line = bytes(buf[:end])
+                m = _NTFY_LINE.match(line) if self._fastNotify else None
+                if m is not None:
+                    resp = self._notificationLine(m)
+                else:
+                    if sys.version_info[0] >= 3:
+                        line = line.decode('utf-8')
+                    DBG("Got:", repr(line))
+                    resp = None if line.startswith('#') else Peripheral.parseResp(line)
+            del buf[:end]
+            if resp is not None:
+                return resp
+
+    def _notificationData(self, buf, start, end):
+        # With notifyViews, the delegate gets a memoryview that is only
+        # valid until it returns: the payload is copied straight from the
+        # receive buffer into one kept for the purpose
+        if not self._views or end - start > len(self._viewBuf):
+            return bytes(buf[start:end])
+        view = self._viewBuf[:end-start]
+        view[:] = buf[start:end]
+        return view
+
+    def _notificationLine(self, m):
+        (rspType, connId, hnd, data, ts, tns, seq) = m.groups()
+        data = binascii.a2b_hex(data)
+        resp = { 'rsp': ['ntfy' if rspType == b'ntfy' else 'ind'],
+                 'hnd': [int(hnd, 16)],
+                 'd': [memoryview(data) if self._views else data],
+                 'ts': [int(ts, 16)], 'tns': [int(tns, 16)],
+                 'seq': [int(seq, 16)] }
+        if connId is not None:
+            resp['id'] = [int(connId, 16)]
+        return resp
+
+    def _notificationFrame(self, buf, end):
+        # Returns None for any frame but a notification or indication
+        if buf.startswith(_NTFY_FRAME, 4):
+            rspType = 'ntfy'
+            pos = 4 + len(_NTFY_FRAME)
+        elif buf.startswith(_IND_FRAME, 4):
+            rspType = 'ind'
+            pos = 4 + len(_IND_FRAME)
+        else:
+            return None
+        resp = { 'rsp': [rspType] }
+        if buf.startswith(b'\x02idh', pos):
+            resp['id'] = [_U32.unpack_from(buf, pos + 4)[0]]
+            pos += 8
+        if not buf.startswith(b'\x03hndh', pos) or \
+           not buf.startswith(b'\x01db', pos + 9):
+            return None
+        (hnd, dlen) = _NTFY_HDR.unpack_from(buf, pos)
+        pos += _NTFY_HDR.size
+        if end != pos + dlen + _NTFY_TAIL.size or \
+           not buf.startswith(b'\x02tsh', pos + dlen):
+            return None
+        (ts, tns, seq) = _NTFY_TAIL.unpack_from(buf, pos + dlen)
+        resp['hnd'] = [hnd]
+        resp['d'] = [self._notificationData(buf, pos, pos + dlen)]
+        resp['ts'] = [ts]
+        resp['tns'] = [tns]
+        resp['seq'] = [seq]
+        return resp
+
+    def readResp(self, timeout=None):
+        # Returns the next response from the helper, whichever connection
+        # it belongs to, or None on timeout
+        if timeout is not None:
+            deadline = time.time() + timeout
+        while True:
+            resp = self._nextBuffered()
+            if resp is not None:
+                return resp
+
+            if self._helper.poll() is not None:
+                raise BTLEException(BTLEException.INTERNAL_ERROR, "Helper exited")
+
+            if timeout is not None:
+                fds = self._poller.poll(max(deadline - time.time(), 0)*1000)
+                if len(fds) == 0:
+                    DBG("Select timeout")
+                    return None
+            self._fill()
+
+    def _dispatch(self, resp):
+        # Hands a response that nobody is waiting for to its owner as an
+        # event, or keeps it until the owner asks for it
+        owner = resp['id'][0] if 'id' in resp else 0
+        periph = self._conns.get(owner)
+        if periph is not None and periph._handleEvent(resp):
+            return
+        if periph is not None:
+            self._pending.setdefault(owner, []).append(resp)
+
+    def _dispatchBuffered(self):
+        count = 0
+        while True:
+            resp = self._nextBuffered()
+            if resp is None:
+                return count
+            self._dispatch(resp)
+            count += 1
+
+    def processEvents(self):
+        # Handles everything the helper has sent so far without blocking,
+        # and returns the number of responses handled
+        if self._helper is None:
+            return 0
+        if self._poller.poll(0):
+            self._fill()
+        return self._dispatchBuffered()
+
+    def getResp(self, connId, timeout=None):
+        # Returns the next response for connection connId. Notifications
+        # go straight to their delegates, connId's own included; anything
+        # else is kept until its owner asks for it. Complete responses left
+        # in the receive buffer are dispatched the same way before
+        # returning, so that fileno() stays readable whenever there is
+        # more to process; waitForNotifications() counts the ones that
+        # were connId's notifications.
+        pending = self._pending.get(connId)
+        if pending:
+            return pending.pop(0)
+        if timeout is not None:
+            deadline = time.time() + timeout
+        while True:
+            resp = self.readResp(deadline - time.time() if timeout is not None else None)
+            if resp is None:
+                return None
+            owner = resp['id'][0] if 'id' in resp else connId
+            if owner == connId:
+                # Delivered before anything after it is parsed, which
+                # keeps notifications in order and notifyViews valid
+                periph = self._conns.get(connId)
+                if periph is not None and 'rsp' in resp and \
+                        resp['rsp'][0] in ('ntfy', 'ind'):
+                    _deliverNotification(periph.delegate, resp)
+                self._dispatchBuffered()
+                return resp
+            # Dropped if its connection has been detached, such as the
+            # error that follows a failed connect in connectMany()
+            self._dispatch(resp)
+
+
+class AsyncioAdapter:
+    """Runs the event processing of a helper, Peripheral or Scanner from an
+       asyncio event loop (Python 3.4 and later)."""
+
+    def __init__(self, obj, loop=None):
+        import asyncio
+        self._obj = obj
+        self._loop = loop if loop is not None else asyncio.get_event_loop()
+        self._fd = obj.fileno()
+        self._loop.add_reader(self._fd, obj.processEvents)
+
+    def close(self):
+        if self._fd is not None:
+            self._loop.remove_reader(self._fd)
+            self._fd = None
+
+
+class Peripheral:
+    def __init__(self, deviceAddr=None, addrType=ADDR_TYPE_PUBLIC,
+                 binaryProtocol=False, helper=None, mtu=None,
+                 notifyViews=False):
+        self._shared = helper is not None
+        self._helper = helper
+        self._binary = binaryProtocol
+        self._views = notifyViews
+        self._connId = 0
+        self.services = {} # Indexed by UUID
+        self.addrType = addrType
+        self.discoveredAllServices = False
+        self.delegate = DefaultDelegate()
+        self.mtu = None
+        self._autoReconnect = 0
+        self._reconnecting = False
+        self._delivered = 0    # Notifications passed on by _handleEvent()
+        if deviceAddr is not None:
+            self.connect(deviceAddr, addrType, mtu)
+
+    def setDelegate(self, delegate_):
+        self.delegate = delegate_
+
+    def _startHelper(self):
+        if self._helper is None:
+            self._helper = BluepyHelper(self._binary, self._views)
+            self._helper.attach(self, 0)
+        if self._shared and self._connId == 0:
+            self._connId = self._helper.attach(self)
+        self._helper.start()
+
+    def _stopHelper(self):
+        if self._helper is None:
+            return
+        if self._shared:
+            if self._connId != 0:
+                self._helper.detach(self._connId)
+                self._connId = 0
+        else:
+            self._helper.stop()
+            self._helper = None
+
+    def _writeCmd(self, cmd):
+        if self._helper is None or (self._shared and self._connId == 0):
+            raise BTLEException(BTLEException.INTERNAL_ERROR,
+                                "Helper not started (did you call connect()?)")
+        if self._reconnecting:
+            self._waitReconnected()
+        if self._connId != 0:
+            cmd = "@%X %s" % (self._connId, cmd)
+        self._helper.writeCmd(cmd)
+
 
     @staticmethod
     def parseResp(line):
@@ -244,34 +572,60 @@ class Peripheral:
                 resp[tag].append(val)
         return resp
 
+    @staticmethod
+    def parseFrame(buf, start, end):
+        # Decodes one binary response frame (see bluepy-helper.c) in place;
+        # only the values themselves are copied out of the receive buffer.
+        resp = {}
+        pos = start + 1
+        while pos < end:
+            (tlen,) = struct.unpack_from('<B', buf, pos)
+            pos += 1
+            tag = buf[pos:pos+tlen].decode('ascii')
+            pos += tlen
+            (vtype,) = struct.unpack_from('<B', buf, pos)
+            pos += 1
+            if vtype == _VAL_UINT:
+                (val,) = struct.unpack_from('<I', buf, pos)
+                pos += 4
+            else:
+                (vlen,) = struct.unpack_from('<H', buf, pos)
+                pos += 2
+                val = bytes(buf[pos:pos+vlen])
+                pos += vlen
+                if vtype != _VAL_DATA:
+                    val = val.decode('utf-8')
+            if tag not in resp:
+                resp[tag] = [val]
+            else:
+                resp[tag].append(val)
+        return resp
+
     def _getResp(self, wantType, timeout=None):
         while True:
-            if self._helper.poll() is not None:
-                raise BTLEException(BTLEException.INTERNAL_ERROR, "Helper exited")
+            resp = self._helper.getResp(self._connId, timeout)
+            if resp is None:
+                return None
 
-            if timeout:
-                fds = self._poller.poll(timeout*1000)
-                if len(fds) == 0:
-                    DBG("Select timeout")
-                    return None
-
-            rv = self._helper.stdout.readline()
-            DBG("Got:", repr(rv))
-            if rv.startswith('#'):
-                continue
-
-            resp = Peripheral.parseResp(rv)
             if 'rsp' not in resp:
                 raise BTLEException(BTLEException.INTERNAL_ERROR,
                                 "No response type indicator")
             respType = resp['rsp'][0]
-            if respType == 'ntfy':
-                hnd = resp['hnd'][0]
-                data = resp['d'][0]
-                self.delegate.handleNotification(hnd, data)
+            if respType in ('ntfy', 'ind'):
+                # Already passed to the delegate by the helper
                 if wantType != respType:
                     continue
 
+            if respType == 'stat' and 'reconn' in resp and \
+                    resp['state'][0] != 'disc':
+                # The helper is bringing a lost link back; whatever was
+                # asked of the old link will never be answered
+                self._reconnectEvent(resp)
+                if self._reconnecting and wantType not in ('ntfy', 'ind'):
+                    raise BTLEException(BTLEException.DISCONNECTED,
+                                        "Device disconnected, reconnecting")
+                continue
+
             if respType == wantType:
                 return resp
             elif respType == 'stat' and resp['state'][0] == 'disc':
@@ -287,14 +641,21 @@ class Peripheral:
         self._writeCmd("stat\n")
         return self._getResp('stat')
 
-    def connect(self, addr, addrType):
+    def _requestConnect(self, addr, addrType, mtu):
         if len(addr.split(":")) != 6:
             raise ValueError("Expected MAC address, got %s" % repr(addr))
         if addrType not in (ADDR_TYPE_PUBLIC, ADDR_TYPE_RANDOM):
             raise ValueError("Expected address type public or random, got {}".format(addrType))
         self._startHelper()
         self.deviceAddr = addr
-        self._writeCmd("conn %s %s\n" % (addr, addrType))
+        self.addrType = addrType
+        if mtu is None:
+            self._writeCmd("conn %s %s\n" % (addr, addrType))
+        else:
+            self._writeCmd("conn %s %s %X\n" % (addr, addrType, mtu))
+
+    def connect(self, addr, addrType, mtu=None):
+        self._requestConnect(addr, addrType, mtu)
         rsp = self._getResp('stat')
         while rsp['state'][0] == 'tryconn':
             rsp = self._getResp('stat')
@@ -302,12 +663,23 @@ class Peripheral:
             self._stopHelper()
             raise BTLEException(BTLEException.DISCONNECTED,
                                 "Failed to connect to peripheral %s, addr type: %s" % (addr, addrType))
+        self.mtu = rsp['mtu'][0]
 
     def disconnect(self):
-        if self._helper is None:
+        if self._helper is None or (self._shared and self._connId == 0):
+            return
+        if not self._helper.isRunning():
+            # A shared helper stopped by its owner
             return
+        self._reconnecting = False
         self._writeCmd("disc\n")
-        self._getResp('stat')
+        if self._autoReconnect:
+            # Skip what is left over from a reconnect in progress
+            resp = self._helper.getResp(self._connId)
+            while resp['rsp'][0] != 'stat' or resp['state'][0] != 'disc':
+                resp = self._helper.getResp(self._connId)
+        else:
+            self._getResp('stat')
         self._stopHelper()
 
     def discoverServices(self):
@@ -362,26 +734,432 @@ class Peripheral:
         resp = self._getResp('rd')
         return resp['d'][0]
 
+    def readCharacteristics(self, handles, sizes=None):
+        """Reads several characteristics with one ATT Read Multiple request.
+           The response holds the values back to back, so to split them
+           the caller must supply the size of each in sizes; otherwise
+           the concatenated values are returned."""
+        if len(handles) == 1:
+            data = self.readCharacteristic(handles[0])
+        else:
+            self._writeCmd("rdm %s\n" % " ".join(["%X" % h for h in handles]))
+            data = self._getResp('rdm')['d'][0]
+        if sizes is None:
+            return data
+        if len(sizes) != len(handles) or sum(sizes) != len(data):
+            raise BTLEException(BTLEException.COMM_ERROR,
+                                "Read Multiple returned %d bytes" % len(data))
+        vals = []
+        pos = 0
+        for size in sizes:
+            vals.append(data[pos:pos+size])
+            pos += size
+        return vals
+
     def writeCharacteristic(self, handle, val, withResponse=False):
         cmd = "wrr" if withResponse else "wr"
         self._writeCmd("%s %X %s\n" % (cmd, handle, binascii.b2a_hex(val).decode('utf-8')))
         return self._getResp('wr')
 
+    def streamWrite(self, handle, val):
+        """Writes a long value to a characteristic as a stream of Write
+           Commands (no response), paced by the helper rather than by a
+           round trip per chunk. Returns (seconds, bytesPerSecond)."""
+        self._writeCmd("wrs %X %s\n" % (handle, binascii.b2a_hex(val).decode('utf-8')))
+        resp = self._getResp('wrs')
+        secs = resp['us'][0] / 1e6
+        rate = resp['len'][0] / secs if secs > 0 else float('inf')
+        return (secs, rate)
+
+    def batch(self, ops):
+        """Performs several reads and writes with a single helper round trip.
+           ops is a sequence of ('rd', handle), ('wr', handle, value) or
+           ('wrr', handle, value) tuples. Returns a list of (status, data)
+           pairs in the same order, where status is the ATT error code
+           (0 for success) and data is the value read."""
+        if not ops:
+            raise ValueError("Empty batch")
+        cmd = "batch"
+        for op in ops:
+            if op[0] == 'rd':
+                cmd += " rd %X" % op[1]
+            elif op[0] in ('wr', 'wrr'):
+                if len(op[2]) == 0:
+                    raise ValueError("Cannot write an empty value in a batch")
+                cmd += " %s %X %s" % (op[0], op[1], binascii.b2a_hex(op[2]).decode('utf-8'))
+            else:
+                raise ValueError("Unknown batch operation %s" % repr(op[0]))
+        self._writeCmd(cmd + "\n")
+        resp = self._getResp('batch')
+        return [ (resp['status'][i], resp['d'][i])
+                 for i in range(len(resp['hnd'])) ]
+
     def setSecurityLevel(self, level):
         self._writeCmd("secu %s\n" % level)
         return self._getResp('stat')
 
     def setMTU(self, mtu):
         self._writeCmd("mtu %x\n" % mtu)
+        rsp = self._getResp('stat')
+        self.mtu = rsp['mtu'][0]
+        return rsp
+
+    def setAutoReconnect(self, maxAttempts):
+        """Has the helper reconnect by itself, up to maxAttempts times
+           with increasing delays, if the link is lost; 0 turns this off.
+           Subscriptions written after this call are restored on the new
+           link. A call in progress when the link drops raises
+           BTLEException(DISCONNECTED); later calls wait for the new link."""
+        self._writeCmd("reconn %X\n" % maxAttempts)
+        self._autoReconnect = maxAttempts
         return self._getResp('stat')
 
+    def _reconnectEvent(self, resp):
+        connected = (resp['state'][0] == 'conn')
+        self._reconnecting = not connected
+        if connected:
+            self.mtu = resp['mtu'][0]
+        if hasattr(self.delegate, 'handleReconnect'):
+            self.delegate.handleReconnect(resp['reconn'][0], connected)
+
+    def _waitReconnected(self):
+        # Waits for the link to come back before sending a command;
+        # notifications still go to the delegate meanwhile
+        while self._reconnecting:
+            resp = self._helper.getResp(self._connId)
+            if resp['rsp'][0] != 'stat' or 'reconn' not in resp:
+                # Left over from before the link was lost, or a
+                # notification the helper has delivered
+                continue
+            elif resp['state'][0] == 'disc':
+                self._reconnecting = False
+                self._stopHelper()
+                raise BTLEException(BTLEException.DISCONNECTED,
+                                    "Device disconnected")
+            else:
+                self._reconnectEvent(resp)
+
+    CONN_PARAM_PRESETS = ('low-latency', 'bulk', 'power-save')
+
+    def setConnectionParameters(self, minInterval, maxInterval=None,
+                                latency=0, timeout=None):
+        """Asks for a new connection interval (in ms, from minInterval to
+           maxInterval), peripheral latency (in connection events) and
+           supervision timeout (in ms), or one of CONN_PARAM_PRESETS passed
+           as minInterval. Needs root, like scanning. Returns
+           the parameters the link was given, as for
+           getConnectionParameters()."""
+        if minInterval in self.CONN_PARAM_PRESETS:
+            self._writeCmd("connparam %s\n" % minInterval)
+        else:
+            if maxInterval is None:
+                maxInterval = minInterval
+            if timeout is None:
+                timeout = min(max(1000, 6 * (1 + latency) * maxInterval), 32000)
+            self._writeCmd("connparam %X %X %X %X\n" % (
+                           int(round(minInterval / 1.25)),
+                           int(round(maxInterval / 1.25)), latency,
+                           int(round(timeout / 10.0))))
+        return self._connParams(self._getResp('stat'))
+
+    def getConnectionParameters(self):
+        """Returns a dict with the link's 'interval' (ms), 'latency'
+           (events) and 'timeout' (ms), or None if they have not been set
+           by setConnectionParameters() on this connection."""
+        return self._connParams(self.status())
+
+    @staticmethod
+    def _connParams(resp):
+        if 'intvl' not in resp:
+            return None
+        return { 'interval': resp['intvl'][0] * 1.25,
+                 'latency': resp['lat'][0],
+                 'timeout': resp['tmo'][0] * 10 }
+
     def waitForNotifications(self, timeout):
+         # One read from the helper can bring in a notification behind the
+         # response a call was waiting for; it has been delivered already
+         if self._delivered:
+             self._delivered = 0
+             return True
          resp = self._getResp('ntfy', timeout)
          return (resp != None)
 
+    def fileno(self):
+        if self._helper is None:
+            raise BTLEException(BTLEException.INTERNAL_ERROR,
+                                "Helper not started (did you call connect()?)")
+        return self._helper.fileno()
+
+    def processEvents(self):
+        if self._helper is None:
+            return 0
+        return self._helper.processEvents()
+
+    def _handleEvent(self, resp):
+        # Called by the helper for a response that arrived while nobody was
+        # waiting for it; returns False to have it kept for _getResp()
+        if resp['rsp'][0] in ('ntfy', 'ind'):
+            _deliverNotification(self.delegate, resp)
+            self._delivered += 1
+            return True
+        if resp['rsp'][0] == 'stat' and 'reconn' in resp and \
+                resp['state'][0] != 'disc':
+            self._reconnectEvent(resp)
+            return True
+        return False
+
     def __del__(self):
         self.disconnect()
 
+class ConnectStats:
+    """Time each device took to connect in connectMany(), from the request
+       to the link coming up (including any wait for its turn)."""
+
+    def __init__(self):
+        self.latency = {}  # Seconds, or None if the device failed
+
+    def record(self, addr, secs):
+        self.latency[addr] = secs
+
+    def failed(self):
+        return [addr for (addr, secs) in self.latency.items() if secs is None]
+
+    def histogram(self, binWidth=0.5):
+        """Returns a list of (binStart, count) pairs covering every device
+           that connected."""
+        times = [secs for secs in self.latency.values() if secs is not None]
+        if not times:
+            return []
+        counts = [0] * (int(max(times) / binWidth) + 1)
+        for secs in times:
+            counts[int(secs / binWidth)] += 1
+        return [(i * binWidth, counts[i]) for i in range(len(counts))]
+
+    def __str__(self):
+        lines = ["%6.2fs %-40s %d" % (start, "#" * min(count, 40), count)
+                 for (start, count) in self.histogram()]
+        lines.append("%d connected, %d failed" %
+                     (len(self.latency) - len(self.failed()), len(self.failed())))
+        return "\n".join(lines)
+
+
+def connectMany(addrs, addrType=ADDR_TYPE_PUBLIC, helper=None, timeout=None,
+                stats=None, mtu=None):
+    """Connects to several peripherals through one helper, which queues the
+       attempts for the controller, and yields each Peripheral as soon as
+       its link is up. addrs holds addresses or (address, addrType) pairs.
+       Devices that fail, or are still not connected after timeout
+       seconds, are skipped; their outcome is recorded in stats, a
+       ConnectStats, along with each connect time."""
+    if helper is None:
+        # Stopped once the last of its peripherals is disconnected
+        helper = BluepyHelper()
+        helper._stopWhenIdle = True
+    helper.start()
+    if stats is None:
+        stats = ConnectStats()
+    waiting = {}  # (Peripheral, start time), indexed by connection id
+    for addr in addrs:
+        if isinstance(addr, tuple):
+            (addr, atype) = addr
+        else:
+            atype = addrType
+        periph = Peripheral(helper=helper)
+        periph._requestConnect(addr, atype, mtu)
+        waiting[periph._connId] = (periph, time.time())
+    if timeout is not None:
+        deadline = time.time() + timeout
+
+    try:
+        while waiting:
+            # Responses may have been set aside while the caller was using an
+            # earlier device
+            resp = None
+            for connId in waiting:
+                if helper._pending.get(connId):
+                    resp = helper._pending[connId].pop(0)
+                    break
+            if resp is None:
+                resp = helper.readResp(deadline - time.time() if timeout is not None else None)
+            if resp is None:
+                break
+            owner = resp['id'][0] if 'id' in resp else 0
+            if owner not in waiting:
+                helper._dispatch(resp)
+                continue
+            if resp['rsp'][0] != 'stat' or resp['state'][0] == 'tryconn':
+                continue
+            (periph, started) = waiting.pop(owner)
+            if resp['state'][0] == 'conn':
+                periph.mtu = resp['mtu'][0]
+                stats.record(periph.deviceAddr, time.time() - started)
+                yield periph
+            else:
+                stats.record(periph.deviceAddr, None)
+                periph._stopHelper()
+    finally:
+        # Timed out, or the caller stopped early: cancel the rest
+        for (periph, started) in waiting.values():
+            periph._writeCmd("disc\n")
+            periph._stopHelper()
+            stats.record(periph.deviceAddr, None)
+        if helper._stopWhenIdle and not helper._conns:
+            helper.stop()
+
+
+class ScanEntry:
+    # Advertising data types (Bluetooth Core Specification Supplement)
+    FLAGS                     = 0x01
+    INCOMPLETE_16B_SERVICES   = 0x02
+    COMPLETE_16B_SERVICES     = 0x03
+    INCOMPLETE_128B_SERVICES  = 0x06
+    COMPLETE_128B_SERVICES    = 0x07
+    SHORT_LOCAL_NAME          = 0x08
+    COMPLETE_LOCAL_NAME       = 0x09
+    TX_POWER                  = 0x0A
+    SERVICE_DATA_16B          = 0x16
+    MANUFACTURER              = 0xFF
+
+    def __init__(self, addr):
+        self.addr = addr
+        self.addrType = None
+        self.rssi = None
+        self.rawData = None
+        self.scanData = {}
+        self.updateCount = 0
+
+    def _update(self, addrType, rssi, data):
+        self.addrType = ADDR_TYPE_RANDOM if addrType else ADDR_TYPE_PUBLIC
+        self.rssi = rssi - 256 if rssi > 127 else rssi
+        self.rawData = data
+        self.updateCount += 1
+        isNewData = False
+        # Advertising data is a sequence of length, type, value structures
+        data = bytearray(data)
+        pos = 0
+        while pos + 1 < len(data):
+            length = data[pos]
+            if length == 0 or pos + 1 + length > len(data):
+                break
+            adType = data[pos+1]
+            val = bytes(data[pos+2:pos+1+length])
+            if self.scanData.get(adType) != val:
+                self.scanData[adType] = val
+                isNewData = True
+            pos += 1 + length
+        return isNewData
+
+    def getScanData(self):
+        return sorted(self.scanData.items())
+
+    def getValue(self, adType):
+        return self.scanData.get(adType)
+
+    def __str__(self):
+        return "ScanEntry %s (%s), RSSI %d dBm" % (self.addr, self.addrType, self.rssi)
+
+
+class Scanner:
+    def __init__(self, helper=None, binaryProtocol=False):
+        self._shared = helper is not None
+        self._helper = helper if helper is not None else BluepyHelper(binaryProtocol)
+        self._connId = 0
+        self.delegate = DefaultDelegate()
+        self.scanned = {}
+
+    def setDelegate(self, delegate_):
+        self.delegate = delegate_
+
+    def _writeCmd(self, cmd):
+        if self._connId != 0:
+            cmd = "@%X %s" % (self._connId, cmd)
+        self._helper.writeCmd(cmd)
+
+    def _getResp(self, wantType, timeout=None):
+        while True:
+            resp = self._helper.getResp(self._connId, timeout)
+            if resp is None:
+                return None
+            respType = resp['rsp'][0]
+            if respType == 'scan' and 'addr' in resp:
+                self._handleReports(resp)
+                if wantType == 'scan':
+                    return resp
+            elif respType == wantType:
+                return resp
+            elif respType == 'err':
+                errcode = resp['code'][0]
+                raise BTLEException(BTLEException.COMM_ERROR, "Error from Bluetooth stack (%s)" % errcode)
+
+    def _handleEvent(self, resp):
+        if resp['rsp'][0] == 'scan' and 'addr' in resp:
+            self._handleReports(resp)
+            return True
+        return False
+
+    def _handleReports(self, resp):
+        for i in range(len(resp['addr'])):
+            addr = resp['addr'][i].lower()
+            dev = self.scanned.get(addr)
+            isNewDev = dev is None
+            if isNewDev:
+                dev = ScanEntry(addr)
+                self.scanned[addr] = dev
+            isNewData = dev._update(resp['type'][i], resp['rssi'][i], resp['d'][i])
+            self.delegate.handleDiscovery(dev, isNewDev, isNewData)
+
+    def clear(self):
+        self.scanned = {}
+
+    def start(self, passive=True, batchInterval=0.2):
+        self._helper.start()
+        if self._shared and self._connId == 0:
+            self._connId = self._helper.attach(self)
+        elif not self._shared:
+            self._helper.attach(self, 0)
+        self._writeCmd("scan %s %X\n" % ("passive" if passive else "active",
+                                         max(1, int(batchInterval * 1000))))
+        # The helper acknowledges with an empty report
+        self._getResp('scan')
+
+    def process(self, timeout=10.0):
+        deadline = time.time() + timeout
+        while True:
+            remain = deadline - time.time()
+            if remain <= 0:
+                break
+            if self._getResp('scan', remain) is None:
+                break
+
+    def stop(self):
+        self._writeCmd("scanend\n")
+        self._getResp('scanend')
+        if self._shared:
+            self._helper.detach(self._connId)
+            self._connId = 0
+        else:
+            self._helper.stop()
+
+    def fileno(self):
+        return self._helper.fileno()
+
+    def processEvents(self):
+        return self._helper.processEvents()
+
+    def getDevices(self):
+        return list(self.scanned.values())
+
+    def scan(self, timeout=10, passive=True):
+        self.clear()
+        self.start(passive)
+        try:
+            self.process(timeout)
+        finally:
+            self.stop()
+        return self.getDevices()
+
+
 def capitaliseName(descr):
     words = descr.split(" ")
     capWords =  [ words[0].lower() ]
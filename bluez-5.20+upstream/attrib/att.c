@@ -819,6 +819,48 @@ ssize_t dec_read_resp(const uint8_t *pdu, size_t len, uint8_t *value,
 	return len - 1;
 }
 
+uint16_t enc_read_multi_req(const uint16_t *handles, size_t n, uint8_t *pdu,
+								size_t len)
+{
+	size_t i;
+
+	if (pdu == NULL || handles == NULL)
+		return 0;
+
+	/* The Set Of Handles holds two or more handles */
+	if (n < 2 || len < 1 + n * sizeof(*handles))
+		return 0;
+
+	/* Attribute Opcode (1 octet) */
+	pdu[0] = ATT_OP_READ_MULTI_REQ;
+	/* Set Of Handles (2 octets each) */
+	for (i = 0; i < n; i++)
+		put_le16(handles[i], &pdu[1 + i * 2]);
+
+	return 1 + n * 2;
+}
+
+ssize_t dec_read_multi_resp(const uint8_t *pdu, size_t len, uint8_t *values,
+								size_t vlen)
+{
+	if (pdu == NULL)
+		return -EINVAL;
+
+	if (pdu[0] != ATT_OP_READ_MULTI_RESP)
+		return -EINVAL;
+
+	if (values == NULL)
+		return len - 1;
+
+	if (vlen < (len - 1))
+		return -ENOBUFS;
+
+	/* Set Of Values, concatenated without lengths */
+	memcpy(values, pdu + 1, len - 1);
+
+	return len - 1;
+}
+
 uint16_t enc_error_resp(uint8_t opcode, uint16_t handle, uint8_t status,
 						uint8_t *pdu, size_t len)
 {
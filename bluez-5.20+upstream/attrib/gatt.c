@@ -875,6 +875,21 @@ guint gatt_read_char(GAttrib *attrib, uint16_t handle, GAttribResultFunc func,
 	return id;
 }
 
+guint gatt_read_char_multi(GAttrib *attrib, const uint16_t *handles, size_t n,
+				GAttribResultFunc func, gpointer user_data)
+{
+	uint8_t *buf;
+	size_t buflen;
+	guint16 plen;
+
+	buf = g_attrib_get_buffer(attrib, &buflen);
+	plen = enc_read_multi_req(handles, n, buf, buflen);
+	if (plen == 0)
+		return 0;
+
+	return g_attrib_send(attrib, 0, buf, plen, func, user_data, NULL);
+}
+
 struct write_long_data {
 	GAttrib *attrib;
 	GAttribResultFunc func;
@@ -66,7 +66,6 @@ struct attrib_callbacks {
 	GDestroyNotify destroy_func;
 	gpointer user_data;
 	GAttrib *parent;
-	uint16_t notify_handle;
 };
 
 static bool find_with_org_id(const void *data, const void *user_data)
@@ -192,6 +191,12 @@ void g_attrib_unref(GAttrib *attrib)
 	if (attrib->destroy)
 		attrib->destroy(attrib->destroy_user_data);
 
+	/*
+	 * The bt_att outlives us when this is called from one of its own
+	 * callbacks (a disconnect handler), so drop the registrations that
+	 * point into attrib->callbacks before freeing them.
+	 */
+	bt_att_unregister_all(attrib->att);
 	bt_att_unref(attrib->att);
 
 	queue_destroy(attrib->callbacks, attrib_callbacks_destroy);
@@ -233,34 +238,33 @@ gboolean g_attrib_set_destroy_function(GAttrib *attrib, GDestroyNotify destroy,
 }
 
 
-static uint8_t *construct_full_pdu(uint8_t opcode, const void *pdu,
-								uint16_t length)
+/*
+ * bt_att passes PDU parameters in place in its receive buffer, so the
+ * opcode is the byte before them and the full PDU can be handed on without
+ * copying. Results without parameters (confirmations and local failures)
+ * have the opcode put in opbuf instead.
+ */
+static const uint8_t *full_pdu(uint8_t opcode, const void *pdu,
+							uint8_t *opbuf)
 {
-	uint8_t *buf = malloc0(length + 1);
-
-	if (!buf)
-		return NULL;
+	if (pdu)
+		return (const uint8_t *) pdu - 1;
 
-	buf[0] = opcode;
-	memcpy(buf + 1, pdu, length);
+	*opbuf = opcode;
 
-	return buf;
+	return opbuf;
 }
 
 static void attrib_callback_result(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
-	uint8_t *buf;
+	uint8_t opbuf;
 	struct attrib_callbacks *cb = user_data;
 	guint8 status = 0;
 
 	if (!cb)
 		return;
 
-	buf = construct_full_pdu(opcode, pdu, length);
-	if (!buf)
-		return;
-
 	if (opcode == BT_ATT_OP_ERROR_RSP) {
 		/* Error code is the third byte of the PDU data */
 		if (length < 4)
@@ -270,34 +274,21 @@ static void attrib_callback_result(uint8_t opcode, const void *pdu,
 	}
 
 	if (cb->result_func)
-		cb->result_func(status, buf, length + 1, cb->user_data);
-
-	free(buf);
+		cb->result_func(status, full_pdu(opcode, pdu, &opbuf),
+						length + 1, cb->user_data);
 }
 
 static void attrib_callback_notify(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data)
 {
-	uint8_t *buf;
+	uint8_t opbuf;
 	struct attrib_callbacks *cb = user_data;
 
 	if (!cb || !cb->notify_func)
 		return;
 
-	if (cb->notify_handle != GATTRIB_ALL_HANDLES && length < 2)
-		return;
-
-	if (cb->notify_handle != GATTRIB_ALL_HANDLES &&
-					cb->notify_handle != get_le16(pdu))
-		return;
-
-	buf = construct_full_pdu(opcode, pdu, length);
-	if (!buf)
-		return;
-
-	cb->notify_func(buf, length + 1, cb->user_data);
-
-	free(buf);
+	cb->notify_func(full_pdu(opcode, pdu, &opbuf), length + 1,
+							cb->user_data);
 }
 
 guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
@@ -324,13 +315,22 @@ guint g_attrib_send(GAttrib *attrib, guint id, const guint8 *pdu, guint16 len,
 		cb->destroy_func = notify;
 		cb->parent = attrib;
 		queue_push_head(attrib->callbacks, cb);
-		response_cb = attrib_callback_result;
 		destroy_cb = attrib_callbacks_remove;
 
+		/* bt_att refuses a response callback for commands */
+		if (func)
+			response_cb = attrib_callback_result;
 	}
 
 	pend_id = bt_att_send(attrib->att, pdu[0], (void *) pdu + 1, len - 1,
 						response_cb, cb, destroy_cb);
+	if (pend_id == 0) {
+		if (cb) {
+			queue_remove(attrib->callbacks, cb);
+			free(cb);
+		}
+		return 0;
+	}
 
 	/*
 	 * We store here pair as it is easier to handle it in response and in
@@ -408,12 +408,15 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 	if (!attrib)
 		return 0;
 
+	/* bt_att only matches handles for a single opcode */
+	if (opcode == GATTRIB_ALL_REQS && handle != GATTRIB_ALL_HANDLES)
+		return 0;
+
 	if (func || notify) {
 		cb = new0(struct attrib_callbacks, 1);
 		if (!cb)
 			return 0;
 		cb->notify_func = func;
-		cb->notify_handle = handle;
 		cb->user_data = user_data;
 		cb->destroy_func = notify;
 		cb->parent = attrib;
@@ -421,10 +424,17 @@ guint g_attrib_register(GAttrib *attrib, guint8 opcode, guint16 handle,
 	}
 
 	if (opcode == GATTRIB_ALL_REQS)
-		opcode = BT_ATT_ALL_REQUESTS;
+		return bt_att_register(attrib->att, BT_ATT_ALL_REQUESTS,
+						attrib_callback_notify, cb,
+						attrib_callbacks_remove);
 
-	return bt_att_register(attrib->att, opcode, attrib_callback_notify,
-						cb, attrib_callbacks_remove);
+	/*
+	 * Let bt_att pick out the handle rather than filtering every PDU;
+	 * GATTRIB_ALL_HANDLES (0) registers for the opcode as a whole
+	 */
+	return bt_att_register_handle(attrib->att, opcode, handle,
+						attrib_callback_notify, cb,
+						attrib_callbacks_remove);
 }
 
 uint8_t *g_attrib_get_buffer(GAttrib *attrib, size_t *len)
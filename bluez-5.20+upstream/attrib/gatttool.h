@@ -28,3 +28,4 @@ GIOChannel *gatt_connect(const char *src, const char *dst,
 			int psm, int mtu, BtIOConnect connect_cb,
 			GError **gerr);
 size_t gatt_attr_data_from_string(const char *str, uint8_t **data);
+ssize_t gatt_attr_data_decode(const char *str, uint8_t *data, size_t size);
@@ -25,6 +25,7 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <stdlib.h>
 
 #include <glib.h>
@@ -34,6 +35,7 @@
 #include "lib/hci_lib.h"
 #include "lib/sdp.h"
 #include "lib/uuid.h"
+#include "src/shared/util.h"
 
 #include "btio/btio.h"
 #include "att.h"
@@ -102,20 +104,34 @@ GIOChannel *gatt_connect(const char *src, const char *dst,
 	return chan;
 }
 
+/*
+ * Decode the hex string str into data, which has room for size bytes. data
+ * may be str itself. Returns the number of bytes decoded, or -EINVAL if str
+ * is not a complete hex string that fits.
+ */
+ssize_t gatt_attr_data_decode(const char *str, uint8_t *data, size_t size)
+{
+	size_t len = strlen(str);
+
+	if (len / 2 > size)
+		return -EINVAL;
+
+	return util_hex_decode(str, len, data);
+}
+
 size_t gatt_attr_data_from_string(const char *str, uint8_t **data)
 {
-	char tmp[3];
-	size_t size, i;
+	size_t size;
 
 	size = strlen(str) / 2;
 	*data = g_try_malloc0(size);
 	if (*data == NULL)
 		return 0;
 
-	tmp[2] = '\0';
-	for (i = 0; i < size; i++) {
-		memcpy(tmp, str + (i * 2), 2);
-		(*data)[i] = (uint8_t) strtol(tmp, NULL, 16);
+	if (util_hex_decode(str, size * 2, *data) < 0) {
+		g_free(*data);
+		*data = NULL;
+		return 0;
 	}
 
 	return size;
@@ -36,6 +36,12 @@
 
 #include <glib.h>
 
+#ifdef MAINLOOP_EPOLL
+#include <sys/epoll.h>
+
+#include "src/shared/mainloop.h"
+#endif
+
 #include "lib/bluetooth.h"
 #include "lib/l2cap.h"
 #include "lib/rfcomm.h"
@@ -163,6 +169,104 @@ static void accept_remove(struct accept *accept)
 	g_free(accept);
 }
 
+#ifdef MAINLOOP_EPOLL
+/*
+ * Without a GLib main loop the watches below run on src/shared/mainloop.c.
+ * The socket is taken off the loop while its callback runs, since the
+ * callback may hand it to code that adds a watch of its own, and put back
+ * if the callback returns TRUE.
+ */
+struct io_watch {
+	GIOChannel *io;
+	GIOCondition cond;
+	GIOFunc func;
+	gpointer user_data;
+	GDestroyNotify destroy;
+	gboolean in_callback;
+};
+
+static void io_watch_free(struct io_watch *watch)
+{
+	if (watch->destroy)
+		watch->destroy(watch->user_data);
+
+	g_io_channel_unref(watch->io);
+	g_free(watch);
+}
+
+static void io_watch_destroy(void *user_data)
+{
+	struct io_watch *watch = user_data;
+
+	if (!watch->in_callback)
+		io_watch_free(watch);
+}
+
+static void io_watch_cb(int fd, uint32_t events, void *user_data);
+
+static gboolean io_watch_start(struct io_watch *watch)
+{
+	uint32_t events = 0;
+
+	if (watch->cond & G_IO_IN)
+		events |= EPOLLIN;
+	if (watch->cond & G_IO_OUT)
+		events |= EPOLLOUT;
+
+	return mainloop_add_fd(g_io_channel_unix_get_fd(watch->io), events,
+				io_watch_cb, watch, io_watch_destroy) == 0;
+}
+
+static void io_watch_cb(int fd, uint32_t events, void *user_data)
+{
+	struct io_watch *watch = user_data;
+	GIOCondition cond = 0;
+	gboolean keep;
+
+	if (events & EPOLLIN)
+		cond |= G_IO_IN;
+	if (events & EPOLLOUT)
+		cond |= G_IO_OUT;
+	if (events & EPOLLERR)
+		cond |= G_IO_ERR;
+	if (events & EPOLLHUP)
+		cond |= G_IO_HUP;
+
+	watch->in_callback = TRUE;
+	mainloop_remove_fd(fd);
+
+	keep = watch->func(watch->io, cond & watch->cond, watch->user_data);
+
+	watch->in_callback = FALSE;
+
+	if (!keep || !io_watch_start(watch))
+		io_watch_free(watch);
+}
+
+static void io_watch_add(GIOChannel *io, GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	struct io_watch *watch;
+
+	watch = g_new0(struct io_watch, 1);
+	watch->io = g_io_channel_ref(io);
+	watch->cond = cond;
+	watch->func = func;
+	watch->user_data = user_data;
+	watch->destroy = destroy;
+
+	if (!io_watch_start(watch))
+		io_watch_free(watch);
+}
+#else
+static void io_watch_add(GIOChannel *io, GIOCondition cond, GIOFunc func,
+				gpointer user_data, GDestroyNotify destroy)
+{
+	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, func, user_data,
+								destroy);
+}
+#endif
+
 static gboolean check_nval(GIOChannel *io)
 {
 	struct pollfd fds;
@@ -282,7 +386,7 @@ static void server_add(GIOChannel *io, BtIOConnect connect,
 	server->destroy = destroy;
 
 	cond = G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, server_cb, server,
+	io_watch_add(io, cond, server_cb, server,
 					(GDestroyNotify) server_remove);
 }
 
@@ -298,7 +402,7 @@ static void connect_add(GIOChannel *io, BtIOConnect connect,
 	conn->destroy = destroy;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, connect_cb, conn,
+	io_watch_add(io, cond, connect_cb, conn,
 					(GDestroyNotify) connect_remove);
 }
 
@@ -314,7 +418,7 @@ static void accept_add(GIOChannel *io, BtIOConnect connect, gpointer user_data,
 	accept->destroy = destroy;
 
 	cond = G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL;
-	g_io_add_watch_full(io, G_PRIORITY_DEFAULT, cond, accept_cb, accept,
+	io_watch_add(io, cond, accept_cb, accept,
 					(GDestroyNotify) accept_remove);
 }
 
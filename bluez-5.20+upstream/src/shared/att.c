@@ -26,8 +26,10 @@
 #endif
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
@@ -56,6 +58,12 @@
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
 
+/* PDUs from write_queue sent per wakeup of the writer */
+#define ATT_WRITE_BATCH_MAX		IO_SEND_BATCH_MAX
+
+/* Buckets for handle-specific callbacks, keyed on opcode and handle */
+#define NOTIFY_HASH_SIZE		64
+
 struct att_send_op;
 
 struct bt_att {
@@ -69,16 +77,23 @@ struct bt_att {
 	struct att_send_op *pending_req;
 	struct queue *ind_queue;	/* Queued ATT protocol indications */
 	struct att_send_op *pending_ind;
+	unsigned int timeout_id;	/* Shared by pending_req and _ind */
 	struct queue *write_queue;	/* Queue of PDUs ready to send */
 	bool writer_active;
+	struct bt_att_write_stats write_stats;
 
 	struct queue *notify_list;	/* List of registered callbacks */
+	struct queue *notify_opcode[256];	/* Callbacks by opcode */
+	struct queue *notify_handle[NOTIFY_HASH_SIZE];	/* and by handle */
+	bool in_notify;
+	bool need_notify_cleanup;
 	struct queue *disconn_list;	/* List of disconnect handlers */
 
 	bool in_req;			/* There's a pending incoming request */
 
 	uint8_t *buf;
 	uint16_t mtu;
+	struct timespec rx_time;	/* Arrival of the PDU in buf */
 
 	unsigned int next_send_id;	/* IDs for "send" ops */
 	unsigned int next_reg_id;	/* IDs for registered callbacks */
@@ -192,7 +207,7 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 
 struct att_send_op {
 	unsigned int id;
-	unsigned int timeout_id;
+	uint64_t deadline;		/* Monotonic ms, once it is pending */
 	enum att_op_type type;
 	uint16_t opcode;
 	void *pdu;
@@ -206,9 +221,6 @@ static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
 
-	if (op->timeout_id)
-		timeout_remove(op->timeout_id);
-
 	if (op->destroy)
 		op->destroy(op->user_data);
 
@@ -228,7 +240,9 @@ static void cancel_att_send_op(struct att_send_op *op)
 
 struct att_notify {
 	unsigned int id;
+	bool removed;
 	uint16_t opcode;
+	uint16_t handle;		/* 0 for all handles */
 	bt_att_notify_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
@@ -252,6 +266,28 @@ static bool match_notify_id(const void *a, const void *b)
 	return notify->id == id;
 }
 
+static bool match_notify_removed(const void *a, const void *b)
+{
+	const struct att_notify *notify = a;
+
+	return notify->removed;
+}
+
+static unsigned int notify_hash(uint8_t opcode, uint16_t handle)
+{
+	return ((opcode << 16 | handle) * 2654435761u) % NOTIFY_HASH_SIZE;
+}
+
+static struct queue **notify_bucket(struct bt_att *att,
+						const struct att_notify *notify)
+{
+	if (notify->handle)
+		return &att->notify_handle[notify_hash(notify->opcode,
+							notify->handle)];
+
+	return &att->notify_opcode[notify->opcode];
+}
+
 struct att_disconn {
 	unsigned int id;
 	bool removed;
@@ -374,11 +410,6 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 {
 	struct att_send_op *op;
 
-	/* See if any operations are already in the write queue */
-	op = queue_pop_head(att->write_queue);
-	if (op)
-		return op;
-
 	/* If there is no pending request, pick an operation from the
 	 * request queue.
 	 */
@@ -400,36 +431,89 @@ static struct att_send_op *pick_next_send_op(struct bt_att *att)
 	return NULL;
 }
 
-struct timeout_data {
-	struct bt_att *att;
-	unsigned int id;
-};
+/*
+ * There is at most one pending request and one pending indication, and
+ * both time out after ATT_TIMEOUT_INTERVAL. Rather than a timer per
+ * operation, each op records its deadline and a single timer runs while
+ * either is pending. Since every new deadline is later than those before
+ * it, an armed timer never needs to be brought forward: when it fires,
+ * it expires what is due and is set again for whatever is left.
+ */
+static uint64_t timeout_now(void)
+{
+	struct timespec ts;
 
-static bool timeout_cb(void *user_data)
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static bool timeout_cb(void *user_data);
+
+static void start_timeout(struct bt_att *att, struct att_send_op *op)
 {
-	struct timeout_data *timeout = user_data;
-	struct bt_att *att = timeout->att;
-	struct att_send_op *op = NULL;
+	op->deadline = timeout_now() + ATT_TIMEOUT_INTERVAL;
 
-	if (att->pending_req && att->pending_req->id == timeout->id) {
-		op = att->pending_req;
-		att->pending_req = NULL;
-	} else if (att->pending_ind && att->pending_ind->id == timeout->id) {
-		op = att->pending_ind;
-		att->pending_ind = NULL;
-	}
+	if (!att->timeout_id)
+		att->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
+								att, NULL);
+}
 
-	if (!op)
-		return false;
+static struct att_send_op *take_expired(struct att_send_op **pending,
+								uint64_t now)
+{
+	struct att_send_op *op = *pending;
+
+	if (!op || op->deadline > now)
+		return NULL;
+
+	*pending = NULL;
 
+	return op;
+}
+
+static void expire_op(struct bt_att *att, struct att_send_op *op)
+{
 	util_debug(att->debug_callback, att->debug_data,
 				"Operation timed out: 0x%02x", op->opcode);
 
 	if (att->timeout_callback)
 		att->timeout_callback(op->id, op->opcode, att->timeout_data);
 
-	op->timeout_id = 0;
 	destroy_att_send_op(op);
+}
+
+static bool timeout_cb(void *user_data)
+{
+	struct bt_att *att = user_data;
+	struct att_send_op *req, *ind;
+	uint64_t now = timeout_now();
+	uint64_t next = 0;
+
+	att->timeout_id = 0;
+
+	req = take_expired(&att->pending_req, now);
+	ind = take_expired(&att->pending_ind, now);
+
+	if (att->pending_req)
+		next = att->pending_req->deadline;
+
+	if (att->pending_ind && (!next || att->pending_ind->deadline < next))
+		next = att->pending_ind->deadline;
+
+	if (next)
+		att->timeout_id = timeout_add(next - now, timeout_cb, att, NULL);
+
+	if (!req && !ind)
+		return false;
+
+	bt_att_ref(att);
+
+	if (req)
+		expire_op(att, req);
+
+	if (ind)
+		expire_op(att, ind);
 
 	/*
 	 * Directly terminate the connection as required by the ATT protocol.
@@ -438,6 +522,8 @@ static bool timeout_cb(void *user_data)
 	 */
 	io_shutdown(att->io);
 
+	bt_att_unref(att);
+
 	return false;
 }
 
@@ -448,14 +534,88 @@ static void write_watch_destroy(void *user_data)
 	att->writer_active = false;
 }
 
+static void write_batch_done(struct bt_att *att, struct att_send_op *op)
+{
+	util_debug(att->debug_callback, att->debug_data,
+					"ATT op 0x%02x", op->opcode);
+
+	util_hexdump('<', op->pdu, op->len, att->debug_callback,
+							att->debug_data);
+
+	/* Set in_req to false to indicate that no request is pending */
+	if (op->type == ATT_OP_TYPE_RSP)
+		att->in_req = false;
+
+	destroy_att_send_op(op);
+}
+
+/*
+ * Everything in write_queue is fire-and-forget, so send as much of it as the
+ * socket takes in one system call. L2CAP keeps message boundaries, so each
+ * PDU still goes out as its own SDU.
+ */
+static void write_batch(struct bt_att *att)
+{
+	struct att_send_op *ops[ATT_WRITE_BATCH_MAX];
+	struct iovec iov[ATT_WRITE_BATCH_MAX];
+	struct bt_att_write_stats *stats = &att->write_stats;
+	unsigned int count = 0, i;
+	int ret;
+
+	while (count < ATT_WRITE_BATCH_MAX) {
+		ops[count] = queue_pop_head(att->write_queue);
+		if (!ops[count])
+			break;
+
+		iov[count].iov_base = ops[count]->pdu;
+		iov[count].iov_len = ops[count]->len;
+		count++;
+	}
+
+	ret = io_send_batch(att->io, iov, count);
+
+	stats->syscalls++;
+
+	if (ret == -EAGAIN || ret == -EWOULDBLOCK || ret == -ENOBUFS) {
+		/* Nothing taken for now: keep it all for the next wakeup */
+		ret = 0;
+	} else if (ret < 0) {
+		util_debug(att->debug_callback, att->debug_data,
+					"write failed: %s", strerror(-ret));
+		if (ops[0]->callback)
+			ops[0]->callback(BT_ATT_OP_ERROR_RSP, NULL, 0,
+							ops[0]->user_data);
+
+		destroy_att_send_op(ops[0]);
+		ret = 1;
+		stats->errors++;
+	} else {
+		for (i = 0; i < (unsigned int) ret; i++)
+			write_batch_done(att, ops[i]);
+
+		stats->batches++;
+		stats->pdus += ret;
+		if ((unsigned int) ret > stats->max_batch)
+			stats->max_batch = ret;
+	}
+
+	/* Put back what the socket did not take, keeping the order */
+	for (i = count; i > (unsigned int) ret; i--)
+		queue_push_head(att->write_queue, ops[i - 1]);
+}
+
 static bool can_write_data(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
 	struct att_send_op *op;
-	struct timeout_data *timeout;
 	ssize_t ret;
 	struct iovec iov;
 
+	if (!queue_isempty(att->write_queue)) {
+		write_batch(att);
+		return true;
+	}
+
 	op = pick_next_send_op(att);
 	if (!op)
 		return false;
@@ -505,14 +665,7 @@ static bool can_write_data(struct io *io, void *user_data)
 		return true;
 	}
 
-	timeout = new0(struct timeout_data, 1);
-	if (!timeout)
-		return true;
-
-	timeout->att = att;
-	timeout->id = op->id;
-	op->timeout_id = timeout_add(ATT_TIMEOUT_INTERVAL, timeout_cb,
-								timeout, free);
+	start_timeout(att, op);
 
 	/* Return true as there may be more operations ready to write. */
 	return true;
@@ -669,24 +822,6 @@ static void handle_conf(struct bt_att *att, uint8_t *pdu, ssize_t pdu_len)
 	wakeup_writer(att);
 }
 
-struct notify_data {
-	uint8_t opcode;
-	uint8_t *pdu;
-	ssize_t pdu_len;
-	bool handler_found;
-};
-
-static bool opcode_match(uint8_t opcode, uint8_t test_opcode)
-{
-	enum att_op_type op_type = get_op_type(test_opcode);
-
-	if (opcode == BT_ATT_ALL_REQUESTS && (op_type == ATT_OP_TYPE_REQ ||
-						op_type == ATT_OP_TYPE_CMD))
-		return true;
-
-	return opcode == test_opcode;
-}
-
 static void respond_not_supported(struct bt_att *att, uint8_t opcode)
 {
 	uint8_t pdu[4];
@@ -737,10 +872,60 @@ fail:
 	return false;
 }
 
+static bool notify_bucket_call(struct queue *bucket, uint8_t opcode,
+					uint16_t handle, uint8_t *pdu,
+					ssize_t pdu_len)
+{
+	const struct queue_entry *entry;
+	bool found = false;
+
+	/*
+	 * Callbacks removed from here on are only marked, and swept after the
+	 * walk, so entries stay valid throughout. Callbacks registered from
+	 * here on are appended to their bucket, so one that matches is called
+	 * in this same walk.
+	 */
+	for (entry = queue_get_entries(bucket); entry; entry = entry->next) {
+		struct att_notify *notify = entry->data;
+
+		if (notify->removed)
+			continue;
+
+		/* Different opcode and handle pairs can share a bucket */
+		if (handle && (notify->opcode != opcode ||
+						notify->handle != handle))
+			continue;
+
+		found = true;
+
+		notify->callback(opcode, pdu, pdu_len, notify->user_data);
+	}
+
+	return found;
+}
+
+static void notify_cleanup(struct bt_att *att)
+{
+	unsigned int i;
+
+	for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+		queue_remove_all(att->notify_handle[i], match_notify_removed,
+								NULL, NULL);
+
+	for (i = 0; i < 256; i++)
+		queue_remove_all(att->notify_opcode[i], match_notify_removed,
+								NULL, NULL);
+
+	queue_remove_all(att->notify_list, match_notify_removed, NULL,
+							destroy_att_notify);
+
+	att->need_notify_cleanup = false;
+}
+
 static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
-	const struct queue_entry *entry;
+	enum att_op_type op_type = get_op_type(opcode);
 	bool found;
 
 	if (opcode & ATT_OP_SIGNED_MASK) {
@@ -751,38 +936,91 @@ static void handle_notify(struct bt_att *att, uint8_t opcode, uint8_t *pdu,
 
 	bt_att_ref(att);
 
+	att->in_notify = true;
+
+	/*
+	 * Only the callbacks that can match are visited: those for this
+	 * opcode and handle, those for this opcode on any handle and, for
+	 * requests and commands, those for all requests.
+	 */
 	found = false;
-	entry = queue_get_entries(att->notify_list);
 
-	while (entry) {
-		struct att_notify *notify = entry->data;
+	if (pdu_len >= 2) {
+		uint16_t handle = get_le16(pdu);
 
-		entry = entry->next;
+		found |= notify_bucket_call(
+				att->notify_handle[notify_hash(opcode, handle)],
+				opcode, handle, pdu, pdu_len);
+	}
 
-		if (!opcode_match(notify->opcode, opcode))
-			continue;
+	found |= notify_bucket_call(att->notify_opcode[opcode], opcode, 0,
+								pdu, pdu_len);
 
-		found = true;
+	if (op_type == ATT_OP_TYPE_REQ || op_type == ATT_OP_TYPE_CMD)
+		found |= notify_bucket_call(
+				att->notify_opcode[BT_ATT_ALL_REQUESTS],
+				opcode, 0, pdu, pdu_len);
 
-		if (notify->callback)
-			notify->callback(opcode, pdu, pdu_len,
-							notify->user_data);
+	att->in_notify = false;
 
-		/* callback could remove all entries from notify list */
-		if (queue_isempty(att->notify_list))
-			break;
-	}
+	if (att->need_notify_cleanup)
+		notify_cleanup(att);
 
 	/*
 	 * If this was a request and no handler was registered for it, respond
 	 * with "Not Supported"
 	 */
-	if (!found && get_op_type(opcode) == ATT_OP_TYPE_REQ)
+	if (!found && op_type == ATT_OP_TYPE_REQ)
 		respond_not_supported(att, opcode);
 
 	bt_att_unref(att);
 }
 
+/*
+ * Read one PDU into att->buf, along with the kernel's receive timestamp
+ * (SO_TIMESTAMPNS) when the socket provides one.
+ */
+static ssize_t read_pdu(struct bt_att *att)
+{
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	iov.iov_base = att->buf;
+	iov.iov_len = att->mtu;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	len = recvmsg(att->fd, &msg, 0);
+	if (len < 0 && errno == ENOTSOCK) {
+		msg.msg_controllen = 0;
+		len = read(att->fd, att->buf, att->mtu);
+	}
+
+	if (len < 0)
+		return len;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+					cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&att->rx_time, CMSG_DATA(cmsg),
+						sizeof(att->rx_time));
+			return len;
+		}
+	}
+
+	/* Otherwise the time of reading is the best there is */
+	clock_gettime(CLOCK_REALTIME, &att->rx_time);
+
+	return len;
+}
+
 static bool can_read_data(struct io *io, void *user_data)
 {
 	struct bt_att *att = user_data;
@@ -790,7 +1028,7 @@ static bool can_read_data(struct io *io, void *user_data)
 	uint8_t *pdu;
 	ssize_t bytes_read;
 
-	bytes_read = read(att->fd, att->buf, att->mtu);
+	bytes_read = read_pdu(att);
 	if (bytes_read < 0)
 		return false;
 
@@ -882,6 +1120,11 @@ static bool is_io_l2cap_based(int fd)
 
 static void bt_att_free(struct bt_att *att)
 {
+	unsigned int i;
+
+	if (att->timeout_id)
+		timeout_remove(att->timeout_id);
+
 	if (att->pending_req)
 		destroy_att_send_op(att->pending_req);
 
@@ -897,6 +1140,12 @@ static void bt_att_free(struct bt_att *att)
 	queue_destroy(att->notify_list, NULL);
 	queue_destroy(att->disconn_list, NULL);
 
+	for (i = 0; i < NOTIFY_HASH_SIZE; i++)
+		queue_destroy(att->notify_handle[i], NULL);
+
+	for (i = 0; i < 256; i++)
+		queue_destroy(att->notify_opcode[i], NULL);
+
 	if (att->timeout_destroy)
 		att->timeout_destroy(att->timeout_data);
 
@@ -914,6 +1163,7 @@ static void bt_att_free(struct bt_att *att)
 struct bt_att *bt_att_new(int fd)
 {
 	struct bt_att *att;
+	int on = 1;
 
 	if (fd < 0)
 		return NULL;
@@ -924,6 +1174,9 @@ struct bt_att *bt_att_new(int fd)
 
 	att->fd = fd;
 
+	/* Have the kernel timestamp received PDUs, if it can */
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+
 	att->mtu = BT_ATT_DEFAULT_LE_MTU;
 	att->buf = malloc(att->mtu);
 	if (!att->buf)
@@ -1030,6 +1283,27 @@ bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 	return true;
 }
 
+bool bt_att_get_rx_time(struct bt_att *att, struct timespec *ts)
+{
+	if (!att || !ts)
+		return false;
+
+	*ts = att->rx_time;
+
+	return true;
+}
+
+bool bt_att_get_write_stats(struct bt_att *att,
+					struct bt_att_write_stats *stats)
+{
+	if (!att || !stats)
+		return false;
+
+	*stats = att->write_stats;
+
+	return true;
+}
+
 uint16_t bt_att_get_mtu(struct bt_att *att)
 {
 	if (!att)
@@ -1297,31 +1571,57 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_notify_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy)
+{
+	return bt_att_register_handle(att, opcode, 0, callback, user_data,
+								destroy);
+}
+
+unsigned int bt_att_register_handle(struct bt_att *att, uint8_t opcode,
+						uint16_t handle,
+						bt_att_notify_func_t callback,
+						void *user_data,
+						bt_att_destroy_func_t destroy)
 {
 	struct att_notify *notify;
+	struct queue **bucket;
 
 	if (!att || !callback || !att->io)
 		return 0;
 
+	/* Handles are only matched for a single opcode */
+	if (handle && opcode == BT_ATT_ALL_REQUESTS)
+		return 0;
+
 	notify = new0(struct att_notify, 1);
 	if (!notify)
 		return 0;
 
 	notify->opcode = opcode;
+	notify->handle = handle;
 	notify->callback = callback;
 	notify->destroy = destroy;
 	notify->user_data = user_data;
 
-	if (att->next_reg_id < 1)
-		att->next_reg_id = 1;
+	bucket = notify_bucket(att, notify);
+	if (!*bucket)
+		*bucket = queue_new();
 
-	notify->id = att->next_reg_id++;
+	if (!*bucket || !queue_push_tail(*bucket, notify)) {
+		free(notify);
+		return 0;
+	}
 
 	if (!queue_push_tail(att->notify_list, notify)) {
+		queue_remove(*bucket, notify);
 		free(notify);
 		return 0;
 	}
 
+	if (att->next_reg_id < 1)
+		att->next_reg_id = 1;
+
+	notify->id = att->next_reg_id++;
+
 	return notify->id;
 }
 
@@ -1332,21 +1632,44 @@ bool bt_att_unregister(struct bt_att *att, unsigned int id)
 	if (!att || !id)
 		return false;
 
-	notify = queue_remove_if(att->notify_list, match_notify_id,
+	notify = queue_find(att->notify_list, match_notify_id,
 							UINT_TO_PTR(id));
-	if (!notify)
+	if (!notify || notify->removed)
 		return false;
 
+	/* Callbacks are being called; leave the lists to handle_notify */
+	if (att->in_notify) {
+		notify->removed = true;
+		att->need_notify_cleanup = true;
+		return true;
+	}
+
+	queue_remove(att->notify_list, notify);
+	queue_remove(*notify_bucket(att, notify), notify);
+
 	destroy_att_notify(notify);
 	return true;
 }
 
+static void mark_notify_removed(void *data, void *user_data)
+{
+	struct att_notify *notify = data;
+
+	notify->removed = true;
+}
+
 bool bt_att_unregister_all(struct bt_att *att)
 {
 	if (!att)
 		return false;
 
-	queue_remove_all(att->notify_list, NULL, NULL, destroy_att_notify);
+	queue_foreach(att->notify_list, mark_notify_removed, NULL);
+
+	if (att->in_notify)
+		att->need_notify_cleanup = true;
+	else
+		notify_cleanup(att);
+
 	queue_remove_all(att->disconn_list, NULL, NULL, destroy_att_disconn);
 
 	return true;
@@ -23,6 +23,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 
 #include "src/shared/att-types.h"
 
@@ -37,6 +38,11 @@ bool bt_att_set_close_on_unref(struct bt_att *att, bool do_close);
 
 int bt_att_get_fd(struct bt_att *att);
 
+/*
+ * A non-NULL pdu passed to response and notify callbacks points into the
+ * receive buffer, directly after the opcode byte, and is only valid for the
+ * duration of the callback.
+ */
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(uint8_t opcode, const void *pdu,
@@ -51,6 +57,25 @@ typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy);
 
+/*
+ * Receive time (CLOCK_REALTIME) of the PDU being handled, taken by the
+ * kernel where the socket supports it. Only meaningful from within a
+ * response or notify callback.
+ */
+bool bt_att_get_rx_time(struct bt_att *att, struct timespec *ts);
+
+/* Counters for the batched writer of commands, notifications and responses */
+struct bt_att_write_stats {
+	unsigned long syscalls;		/* Send attempts */
+	unsigned long batches;		/* Successful sends */
+	unsigned long pdus;		/* PDUs sent by them */
+	unsigned long errors;		/* PDUs dropped on a send error */
+	unsigned int max_batch;		/* Most PDUs sent in one go */
+};
+
+bool bt_att_get_write_stats(struct bt_att *att,
+					struct bt_att_write_stats *stats);
+
 uint16_t bt_att_get_mtu(struct bt_att *att);
 bool bt_att_set_mtu(struct bt_att *att, uint16_t mtu);
 
@@ -73,6 +98,12 @@ unsigned int bt_att_register(struct bt_att *att, uint8_t opcode,
 						bt_att_notify_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
+/* As above, for PDUs whose parameters start with the given handle */
+unsigned int bt_att_register_handle(struct bt_att *att, uint8_t opcode,
+						uint16_t handle,
+						bt_att_notify_func_t callback,
+						void *user_data,
+						bt_att_destroy_func_t destroy);
 bool bt_att_unregister(struct bt_att *att, unsigned int id);
 
 unsigned int bt_att_register_disconnect(struct bt_att *att,
@@ -52,7 +52,11 @@ static const bt_uuid_t included_service_uuid = { .type = BT_UUID16,
 struct gatt_db {
 	int ref_count;
 	uint16_t next_handle;
-	struct queue *services;
+	struct queue *services;		/* Sorted by handle */
+
+	struct gatt_db_service **index;	/* Copy of services, for searching */
+	unsigned int index_len;
+	bool index_valid;
 
 	struct queue *notify_list;
 	unsigned int next_notify_id;
@@ -313,6 +317,7 @@ static void gatt_db_destroy(struct gatt_db *db)
 	db->notify_list = NULL;
 
 	queue_destroy(db->services, gatt_db_service_destroy);
+	free(db->index);
 	free(db);
 }
 
@@ -424,6 +429,7 @@ bool gatt_db_remove_service(struct gatt_db *db,
 	service = attrib->service;
 
 	queue_remove(db->services, service);
+	db->index_valid = false;
 
 	gatt_db_service_destroy(service);
 
@@ -436,6 +442,7 @@ bool gatt_db_clear(struct gatt_db *db)
 		return false;
 
 	queue_remove_all(db->services, NULL, NULL, gatt_db_service_destroy);
+	db->index_valid = false;
 
 	db->next_handle = 0;
 
@@ -482,6 +489,7 @@ bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
 
 	queue_remove_all(db->services, match_range, &range,
 						gatt_db_service_destroy);
+	db->index_valid = false;
 
 	return true;
 }
@@ -552,6 +560,7 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 	service->db = db;
 	service->attributes[0]->handle = handle;
 	service->num_handles = num_handles;
+	db->index_valid = false;
 
 	/* Fast-forward next_handle if the new service was added to the end */
 	db->next_handle = MAX(handle + num_handles, db->next_handle);
@@ -641,6 +650,18 @@ static uint16_t get_handle_at_index(struct gatt_db_service *service,
 	return service->attributes[index]->handle;
 }
 
+/*
+ * Attributes are kept in handle order, which the handle lookups rely on,
+ * so one inserted at index must come after the one before it and within
+ * the service
+ */
+static bool handle_fits(struct gatt_db_service *service, int index,
+							uint16_t handle)
+{
+	return handle > get_handle_at_index(service, index - 1) &&
+		handle < service->attributes[0]->handle + service->num_handles;
+}
+
 static struct gatt_db_attribute *
 attribute_update(struct gatt_db_service *service, int index)
 {
@@ -681,10 +702,6 @@ service_insert_characteristic(struct gatt_db_service *service,
 	uint16_t len = 0;
 	int i;
 
-	/* Check if handle is in within service range */
-	if (handle && handle <= service->attributes[0]->handle)
-		return NULL;
-
 	i = get_attribute_index(service, 1);
 	if (!i)
 		return NULL;
@@ -692,6 +709,11 @@ service_insert_characteristic(struct gatt_db_service *service,
 	if (!handle)
 		handle = get_handle_at_index(service, i - 1) + 2;
 
+	/* The declaration goes at handle - 1 */
+	if (!handle_fits(service, i, handle - 1) ||
+					!handle_fits(service, i, handle))
+		return NULL;
+
 	value[0] = properties;
 	len += sizeof(properties);
 
@@ -772,13 +794,12 @@ service_insert_descriptor(struct gatt_db_service *service,
 	if (!i)
 		return NULL;
 
-	/* Check if handle is in within service range */
-	if (handle && handle <= service->attributes[0]->handle)
-		return NULL;
-
 	if (!handle)
 		handle = get_handle_at_index(service, i - 1) + 1;
 
+	if (!handle_fits(service, i, handle))
+		return NULL;
+
 	service->attributes[i] = new_attribute(service, handle, uuid, NULL, 0);
 	if (!service->attributes[i])
 		return NULL;
@@ -923,6 +944,120 @@ bool gatt_db_service_get_claimed(struct gatt_db_attribute *attrib)
 	return attrib->service->claimed;
 }
 
+/*
+ * Handle lookups are answered from a sorted array of the services, built
+ * again after services are added or removed, and from the attribute's
+ * offset within its service: attributes are stored in handle order (see
+ * handle_fits()) and, unless they were inserted at chosen handles,
+ * without gaps.
+ */
+static bool update_index(struct gatt_db *db)
+{
+	const struct queue_entry *entry;
+	struct gatt_db_service **index;
+	unsigned int len;
+
+	if (db->index_valid)
+		return true;
+
+	len = queue_length(db->services);
+	index = realloc(db->index, (len ? len : 1) * sizeof(*index));
+	if (!index)
+		return false;
+
+	db->index = index;
+	db->index_len = 0;
+
+	for (entry = queue_get_entries(db->services); entry;
+							entry = entry->next)
+		index[db->index_len++] = entry->data;
+
+	db->index_valid = true;
+
+	return true;
+}
+
+/* Position in the index of the first service ending at or after handle */
+static unsigned int find_service_index(struct gatt_db *db, uint16_t handle)
+{
+	unsigned int lo = 0, hi, mid;
+	uint16_t end;
+
+	if (!update_index(db))
+		return 0;
+
+	hi = db->index_len;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		gatt_db_service_get_handles(db->index[mid], NULL, &end);
+
+		if (end < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Index of the first attribute in service at or after handle */
+static int find_attribute_index(const struct gatt_db_service *service,
+							uint16_t handle)
+{
+	struct gatt_db_attribute *attr;
+	int lo = 0, hi = service->num_handles, mid;
+
+	if (handle <= service->attributes[0]->handle)
+		return 0;
+
+	mid = handle - service->attributes[0]->handle;
+	if (mid < hi) {
+		attr = service->attributes[mid];
+		if (attr && attr->handle == handle)
+			return mid;
+	}
+
+	/* Unused entries are all at the end */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		attr = service->attributes[mid];
+
+		if (attr && attr->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Calls func for each service overlapping start_handle to end_handle */
+static void foreach_service_overlapping(struct gatt_db *db,
+						uint16_t start_handle,
+						uint16_t end_handle,
+						queue_foreach_func_t func,
+						void *user_data)
+{
+	struct gatt_db_service *service;
+	unsigned int i;
+	uint16_t start;
+
+	if (start_handle > end_handle)
+		return;
+
+	for (i = find_service_index(db, start_handle); i < db->index_len;
+									i++) {
+		service = db->index[i];
+
+		gatt_db_service_get_handles(service, &start, NULL);
+		if (start > end_handle)
+			break;
+
+		func(service, user_data);
+	}
+}
+
 void gatt_db_read_by_group_type(struct gatt_db *db, uint16_t start_handle,
 							uint16_t end_handle,
 							const bt_uuid_t type,
@@ -987,7 +1122,9 @@ static void find_by_type(void *data, void *user_data)
 	if (!service->active)
 		return;
 
-	for (i = 0; i < service->num_handles; i++) {
+	i = find_attribute_index(service, search_data->start_handle);
+
+	for (; i < service->num_handles; i++) {
 		attribute = service->attributes[i];
 
 		if (!attribute)
@@ -1027,7 +1164,8 @@ unsigned int gatt_db_find_by_type(struct gatt_db *db, uint16_t start_handle,
 	data.func = func;
 	data.user_data = user_data;
 
-	queue_foreach(db->services, find_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+							find_by_type, &data);
 
 	return data.num_of_res;
 }
@@ -1050,8 +1188,10 @@ unsigned int gatt_db_find_by_type_value(struct gatt_db *db,
 	data.user_data = user_data;
 	data.value = value;
 	data.value_len = value_len;
+	data.num_of_res = 0;
 
-	queue_foreach(db->services, find_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+							find_by_type, &data);
 
 	return data.num_of_res;
 }
@@ -1073,7 +1213,9 @@ static void read_by_type(void *data, void *user_data)
 	if (!service->active)
 		return;
 
-	for (i = 0; i < service->num_handles; i++) {
+	i = find_attribute_index(service, search_data->start_handle);
+
+	for (; i < service->num_handles; i++) {
 		attribute = service->attributes[i];
 		if (!attribute)
 			continue;
@@ -1102,7 +1244,8 @@ void gatt_db_read_by_type(struct gatt_db *db, uint16_t start_handle,
 	data.end_handle = end_handle;
 	data.queue = queue;
 
-	queue_foreach(db->services, read_by_type, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+							read_by_type, &data);
 }
 
 
@@ -1127,7 +1270,9 @@ static void find_information(void *data, void *user_data)
 						search_data->start_handle)
 		return;
 
-	for (i = 0; i < service->num_handles; i++) {
+	i = find_attribute_index(service, search_data->start_handle);
+
+	for (; i < service->num_handles; i++) {
 		attribute = service->attributes[i];
 		if (!attribute)
 			continue;
@@ -1152,7 +1297,8 @@ void gatt_db_find_information(struct gatt_db *db, uint16_t start_handle,
 	data.end_handle = end_handle;
 	data.queue = queue;
 
-	queue_foreach(db->services, find_information, &data);
+	foreach_service_overlapping(db, start_handle, end_handle,
+						find_information, &data);
 }
 
 void gatt_db_foreach_service(struct gatt_db *db, const bt_uuid_t *uuid,
@@ -1293,40 +1439,37 @@ void gatt_db_service_foreach_incl(struct gatt_db_attribute *attrib,
 								user_data);
 }
 
-static bool find_service_for_handle(const void *data, const void *user_data)
-{
-	const struct gatt_db_service *service = data;
-	uint16_t handle = PTR_TO_UINT(user_data);
-	uint16_t start, end;
-
-	gatt_db_service_get_handles(service, &start, &end);
-
-	return (start <= handle) && (handle <= end);
-}
-
 struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 							uint16_t handle)
 {
 	struct gatt_db_service *service;
-	int i;
+	struct gatt_db_attribute *attr;
+	unsigned int i;
+	uint16_t start;
+	int index;
 
 	if (!db || !handle)
 		return NULL;
 
-	service = queue_find(db->services, find_service_for_handle,
-							UINT_TO_PTR(handle));
-	if (!service)
+	i = find_service_index(db, handle);
+	if (i >= db->index_len)
 		return NULL;
 
-	for (i = 0; i < service->num_handles; i++) {
-		if (!service->attributes[i])
-			continue;
+	service = db->index[i];
 
-		if (service->attributes[i]->handle == handle)
-			return service->attributes[i];
-	}
+	gatt_db_service_get_handles(service, &start, NULL);
+	if (start > handle)
+		return NULL;
 
-	return NULL;
+	index = find_attribute_index(service, handle);
+	if (index >= service->num_handles)
+		return NULL;
+
+	attr = service->attributes[index];
+	if (!attr || attr->handle != handle)
+		return NULL;
+
+	return attr;
 }
 
 static bool find_service_with_uuid(const void *data, const void *user_data)
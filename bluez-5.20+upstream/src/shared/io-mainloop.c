@@ -27,6 +27,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #include "src/shared/mainloop.h"
@@ -318,6 +319,67 @@ ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt)
 	return ret;
 }
 
+/*
+ * Send each of msgs as a separate datagram, in as few system calls as
+ * possible. Returns the number of messages sent, which may be less than
+ * count if the socket fills up, or a negative errno if the first one
+ * could not be sent.
+ */
+int io_send_batch(struct io *io, const struct iovec *msgs, unsigned int count)
+{
+	struct mmsghdr hdr[IO_SEND_BATCH_MAX];
+	unsigned int sent = 0, i, n;
+	int fd, ret;
+
+	if (!io || io->fd < 0)
+		return -ENOTCONN;
+
+	fd = io->fd;
+
+	while (sent < count) {
+		n = count - sent;
+		if (n > IO_SEND_BATCH_MAX)
+			n = IO_SEND_BATCH_MAX;
+
+		memset(hdr, 0, n * sizeof(hdr[0]));
+		for (i = 0; i < n; i++) {
+			hdr[i].msg_hdr.msg_iov = (struct iovec *) &msgs[sent + i];
+			hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		do {
+			ret = sendmmsg(fd, hdr, n, MSG_DONTWAIT);
+		} while (ret < 0 && errno == EINTR);
+
+		/*
+		 * bt_att_new() takes any fd, not only sockets, and
+		 * sendmmsg() needs a socket: write one PDU at a time
+		 */
+		if (ret < 0 && errno == ENOTSOCK) {
+			for (ret = 0; ret < (int) n; ret++) {
+				if (io_send(io, &msgs[sent + ret], 1) < 0)
+					break;
+			}
+
+			if (ret == 0)
+				ret = -1;
+		}
+
+		if (ret < 0) {
+			if (sent)
+				break;
+
+			return -errno;
+		}
+
+		sent += ret;
+		if ((unsigned int) ret < n)
+			break;
+	}
+
+	return sent;
+}
+
 bool io_shutdown(struct io *io)
 {
 	if (!io || io->fd < 0)
@@ -24,6 +24,9 @@
 #include <stdbool.h>
 #include <sys/uio.h>
 
+/* Messages handed to the kernel per io_send_batch() system call */
+#define IO_SEND_BATCH_MAX	32
+
 typedef void (*io_destroy_func_t)(void *data);
 
 struct io;
@@ -35,6 +38,7 @@ int io_get_fd(struct io *io);
 bool io_set_close_on_destroy(struct io *io, bool do_close);
 
 ssize_t io_send(struct io *io, const struct iovec *iov, int iovcnt);
+int io_send_batch(struct io *io, const struct iovec *msgs, unsigned int count);
 bool io_shutdown(struct io *io);
 
 typedef bool (*io_callback_func_t)(struct io *io, void *user_data);
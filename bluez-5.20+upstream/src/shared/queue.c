@@ -88,19 +88,55 @@ static struct queue_entry *queue_entry_ref(struct queue_entry *entry)
 	return entry;
 }
 
+/*
+ * Entries are allocated and freed for every push and pop, so a few freed
+ * ones are kept per thread for reuse, chained through their next pointers.
+ */
+#define ENTRY_POOL_MAX 128
+
+static __thread struct queue_entry *entry_pool;
+static __thread unsigned int entry_pool_len;
+
+static struct queue_entry *entry_alloc(void)
+{
+	struct queue_entry *entry = entry_pool;
+
+	if (!entry)
+		return new0(struct queue_entry, 1);
+
+	entry_pool = entry->next;
+	entry_pool_len--;
+	entry->next = NULL;
+
+	return entry;
+}
+
+static void entry_free(struct queue_entry *entry)
+{
+	if (entry_pool_len >= ENTRY_POOL_MAX) {
+		free(entry);
+		return;
+	}
+
+	entry->data = NULL;
+	entry->next = entry_pool;
+	entry_pool = entry;
+	entry_pool_len++;
+}
+
 static void queue_entry_unref(struct queue_entry *entry)
 {
 	if (__sync_sub_and_fetch(&entry->ref_count, 1))
 		return;
 
-	free(entry);
+	entry_free(entry);
 }
 
 static struct queue_entry *queue_entry_new(void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
+	entry = entry_alloc();
 	if (!entry)
 		return NULL;
 
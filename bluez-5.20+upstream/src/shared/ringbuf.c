@@ -220,54 +220,64 @@ int ringbuf_printf(struct ringbuf *ringbuf, const char *format, ...)
 	return len;
 }
 
-int ringbuf_vprintf(struct ringbuf *ringbuf, const char *format, va_list ap)
+ssize_t ringbuf_append(struct ringbuf *ringbuf, const void *data, size_t len)
 {
 	size_t avail, offset, end;
-	char *str;
-	int len;
 
-	if (!ringbuf || !format)
+	if (!ringbuf || (len && !data))
 		return -1;
 
-	/* Determine maximum length available for string */
+	/* Determine maximum length available */
 	avail = ringbuf->size - ringbuf->in + ringbuf->out;
-	if (!avail)
-		return -1;
-
-	len = vasprintf(&str, format, ap);
-	if (len < 0)
+	if (len > avail)
 		return -1;
 
-	if ((size_t) len > avail) {
-		free(str);
-		return -1;
-	}
-
-	/* Determine possible length of string before wrapping */
+	/* Determine possible length of data before wrapping */
 	offset = ringbuf->in & (ringbuf->size - 1);
-	end = MIN((size_t) len, ringbuf->size - offset);
-	memcpy(ringbuf->buffer + offset, str, end);
+	end = MIN(len, ringbuf->size - offset);
+	memcpy(ringbuf->buffer + offset, data, end);
 
 	if (ringbuf->in_tracing)
 		ringbuf->in_tracing(ringbuf->buffer + offset, end,
 							ringbuf->in_data);
 
 	if (len - end > 0) {
-		/* Put the remainder of string at the beginning */
-		memcpy(ringbuf->buffer, str + end, len - end);
+		/* Put the remainder of data at the beginning */
+		memcpy(ringbuf->buffer, (const uint8_t *) data + end, len - end);
 
 		if (ringbuf->in_tracing)
 			ringbuf->in_tracing(ringbuf->buffer, len - end,
 							ringbuf->in_data);
 	}
 
-	free(str);
-
 	ringbuf->in += len;
 
 	return len;
 }
 
+int ringbuf_vprintf(struct ringbuf *ringbuf, const char *format, va_list ap)
+{
+	char *str;
+	int len;
+
+	if (!ringbuf || !format)
+		return -1;
+
+	/* Determine maximum length available for string */
+	if (!ringbuf_avail(ringbuf))
+		return -1;
+
+	len = vasprintf(&str, format, ap);
+	if (len < 0)
+		return -1;
+
+	len = ringbuf_append(ringbuf, str, len);
+
+	free(str);
+
+	return len;
+}
+
 ssize_t ringbuf_read(struct ringbuf *ringbuf, int fd)
 {
 	size_t avail, offset, end;
@@ -44,6 +44,7 @@ void *ringbuf_peek(struct ringbuf *ringbuf, size_t offset, size_t *len_nowrap);
 ssize_t ringbuf_write(struct ringbuf *ringbuf, int fd);
 
 size_t ringbuf_avail(struct ringbuf *ringbuf);
+ssize_t ringbuf_append(struct ringbuf *ringbuf, const void *data, size_t len);
 int ringbuf_printf(struct ringbuf *ringbuf, const char *format, ...)
 					__attribute__((format(printf, 2, 3)));
 int ringbuf_vprintf(struct ringbuf *ringbuf, const char *format, va_list ap);
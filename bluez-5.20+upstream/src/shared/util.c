@@ -26,6 +26,7 @@
 #endif
 
 #include <stdio.h>
+#include <errno.h>
 #include <ctype.h>
 #include <stdarg.h>
 #include <sys/types.h>
@@ -95,6 +96,62 @@ void util_hexdump(const char dir, const unsigned char *buf, size_t len,
 	}
 }
 
+#define HEX_ROW(h) h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+			h "8" h "9" h "A" h "B" h "C" h "D" h "E" h "F"
+
+/* The two hex digits of each byte value, so encoding is one copy per byte */
+static const char hex_pairs[] = HEX_ROW("0") HEX_ROW("1") HEX_ROW("2")
+				HEX_ROW("3") HEX_ROW("4") HEX_ROW("5")
+				HEX_ROW("6") HEX_ROW("7") HEX_ROW("8")
+				HEX_ROW("9") HEX_ROW("A") HEX_ROW("B")
+				HEX_ROW("C") HEX_ROW("D") HEX_ROW("E")
+				HEX_ROW("F");
+
+/* Digit values, with 0x10 set for every valid hex digit */
+static const uint8_t hex_values[256] = {
+	['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13,
+	['4'] = 0x14, ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17,
+	['8'] = 0x18, ['9'] = 0x19,
+	['A'] = 0x1a, ['B'] = 0x1b, ['C'] = 0x1c, ['D'] = 0x1d,
+	['E'] = 0x1e, ['F'] = 0x1f,
+	['a'] = 0x1a, ['b'] = 0x1b, ['c'] = 0x1c, ['d'] = 0x1d,
+	['e'] = 0x1e, ['f'] = 0x1f,
+};
+
+/* Writes 2 * len uppercase hex digits to dst, without a terminating NUL */
+void util_hex_encode(const uint8_t *src, size_t len, char *dst)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		memcpy(dst + 2 * i, &hex_pairs[2 * src[i]], 2);
+}
+
+/*
+ * Decodes the len hex digits at src into len / 2 bytes at dst, which may be
+ * src itself. Returns the number of bytes, or -EINVAL if len is odd or src
+ * holds anything but hex digits.
+ */
+ssize_t util_hex_decode(const char *src, size_t len, uint8_t *dst)
+{
+	uint8_t hi, lo;
+	size_t i;
+
+	if (len % 2)
+		return -EINVAL;
+
+	for (i = 0; i < len / 2; i++) {
+		hi = hex_values[(uint8_t) src[2 * i]];
+		lo = hex_values[(uint8_t) src[2 * i + 1]];
+		if (!(hi & lo & 0x10))
+			return -EINVAL;
+
+		dst[i] = hi << 4 | (lo & 0x0f);
+	}
+
+	return len / 2;
+}
+
 /* Helper for getting the dirent type in case readdir returns DT_UNKNOWN */
 unsigned char util_get_dt(const char *parent, const char *name)
 {
@@ -23,6 +23,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 #include <alloca.h>
 #include <byteswap.h>
 
@@ -91,6 +92,9 @@ void util_debug(util_debug_func_t function, void *user_data,
 void util_hexdump(const char dir, const unsigned char *buf, size_t len,
 				util_debug_func_t function, void *user_data);
 
+void util_hex_encode(const uint8_t *src, size_t len, char *dst);
+ssize_t util_hex_decode(const char *src, size_t len, uint8_t *dst);
+
 unsigned char util_get_dt(const char *parent, const char *name);
 
 uint8_t util_get_uid(unsigned int *bitmap, uint8_t max);